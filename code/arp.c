@@ -9,20 +9,50 @@
 #include "project.h"
 #include "bmz.h"
 #include "tcpip.h"
+#include "tick.h"
 #include "arp.h"
 
 // Values of state variable in CACHE_ENTRY
 #define IDLE     0
 #define WAITING  1
 #define BOUND    2
+#define FAILED   3  // no answer, for a while we won't ask again
+
+// The cache is ARP_CACHE_NBR entries (see lengths.h). Entries are found
+//  through a small hash table of chains, so lookup cost doesn't grow with
+//  the cache size, and the entry that was found last time is checked
+//  first, since consecutive frames usually go to the same next hop. When
+//  a new IP address needs an entry, an idle entry is used if possible,
+//  otherwise the least recently used bound entry is taken over.
+// Bindings are learnt from ARP requests for our address and, via
+//  arp_learn(), from the source of IP frames sent to us from our subnet,
+//  so replying to a peer doesn't usually need an ARP round trip. We
+//  announce ourselves with gratuitous ARP at startup, so peers can do the
+//  same.
+// Frames waiting for an address to be resolved are held in a single
+//  pending queue shared by all entries, so total memory is bounded no
+//  matter how many addresses are unresolved. When an address doesn't
+//  answer, its entry is marked FAILED for a while, and frames for it are
+//  discarded straight away, rather than starting a new round of broadcast
+//  requests for every frame.
 
 // Misc
-#define CACHE_NBR       4
+#define HASH_NBR        8       // must be a power of 2
+#define HASH(ipaddr)    ( (byte)((ipaddr)^((ipaddr)>>8)) & (HASH_NBR-1) )
+#define NO_ENTRY        0xff    // end of hash chain
+#define REQUEST_NBR     2       // MSGs for ARP requests and replies
 #define OPCODE_REQUEST  1
 #define OPCODE_REPLY    2
 #define TIMER_RETRY     1
 #define TIMER_FLUSH     10*60   // 10 minutes
+#define TIMER_FLUSH_SLACK 60  // may be up to a minute late
 #define RETRY_LIMIT     3
+#define TIMER_FAILED    20      // remember failures for 20 seconds
+#define TIMER_ID_ANNOUNCE ARP_CACHE_NBR // cache entries use timer ids
+                                        //  0 to ARP_CACHE_NBR-1
+#define ANNOUNCE_WAIT   1       // first announcement after 1 second
+#define ANNOUNCE_INTERVAL 2     // then every 2 seconds
+#define ANNOUNCE_NBR    2       // nbr of announcements
 static const byte eth_broadcast[ETHADDR_LEN] = {0xff,0xff,0xff,0xff,0xff,0xff};
 static const byte all_zero     [ETHADDR_LEN] = {0,0,0,0,0,0};
 
@@ -30,27 +60,38 @@ static const byte all_zero     [ETHADDR_LEN] = {0,0,0,0,0,0};
 typedef struct
 {
     byte    state;
-    MQ      mq;
+    byte    next;           // next entry in hash chain
     IPADDR  ipaddr;
     byte    ethaddr[ ETHADDR_LEN ];
     TIMER   timer;
     byte    retry_count;
+    u32     last_used;      // tick count, for LRU replacement
 } CACHE_ENTRY;
 
 // Module data
 typedef struct
 {
     POOL        pool;
-    CACHE_ENTRY cache[CACHE_NBR];
+    CACHE_ENTRY cache[ARP_CACHE_NBR];
+    byte        hash[HASH_NBR];     // first entry in each hash chain
+    CACHE_ENTRY *last_hit;          // last entry found by lookup()
+    MSG         *pending[ARP_PENDING_NBR];      // frames waiting, oldest
+    byte        pending_entry[ARP_PENDING_NBR]; //  first, and the cache
+    byte        nbr_pending;                    //  entry of each
+    TIMER       timer_announce;
+    byte        announce_count;
 } ARP;
 static ARP z;
 
 // Local prototypes
-static void send_request( MSG *msg, IPADDR ipaddr );
-static void send_reply( MSG *msg, IPADDR target_ipaddr,
-                                                 ETHADDR target_ethaddr );
+static void send_request( IPADDR ipaddr );
+static void send_reply( IPADDR target_ipaddr, ETHADDR target_ethaddr );
 static CACHE_ENTRY *lookup( IPADDR ipaddr );
 static CACHE_ENTRY *select( IPADDR ipaddr );
+static void bind( CACHE_ENTRY *p, ETHADDR ethaddr );
+static void pending_release( CACHE_ENTRY *p, bool send );
+static void hash_link( CACHE_ENTRY *p );
+static void hash_unlink( CACHE_ENTRY *p );
 
 /*************************************************************************
  * Init
@@ -61,14 +102,22 @@ void *arp_init( byte **addr_mem, u16 *addr_len )
     CACHE_ENTRY *p;
     TIMER *timer;
     pool_init( &z.pool, addr_mem, addr_len,
-                                    CACHE_NBR, ETH_MINFRAME, ETH_OFFSET );
-    for( i=0, p=z.cache; i<CACHE_NBR; i++, p++ )
+                                  REQUEST_NBR, ETH_MINFRAME, ETH_OFFSET );
+    memset( z.hash, NO_ENTRY, sizeof(z.hash) );
+    z.last_hit = NULL;
+    for( i=0, p=z.cache; i<ARP_CACHE_NBR; i++, p++ )
     {
         p->state = IDLE;
+        p->next  = NO_ENTRY;
         timer = &p->timer;
         timer_reset( timer, i );
-        mq_init( &p->mq, addr_mem, addr_len, DEFAULT_MQ_DEPTH );
     }
+    z.nbr_pending = 0;
+
+    // Announce ourselves once the link has had a chance to come up
+    timer_reset( &z.timer_announce, TIMER_ID_ANNOUNCE );
+    z.announce_count = 0;
+    timer_start_seconds( &z.timer_announce, ANNOUNCE_WAIT );
     return &z;
 }
 
@@ -116,17 +165,29 @@ void arp_down( MSG *msg )
         // No, select a cache slot ...
         p = select(ipaddr);
 
-        // ... and queue the message in anticipation of getting
-        //  the IP address later
-        if( !mq_write(&p->mq,msg) )
+        // ... discard the message if we've recently failed to get the
+        //  physical address ...
+        if( p->state == FAILED )
+        {
+            msg_free(msg);
+            return;
+        }
+
+        // ... otherwise queue it in anticipation of getting the
+        //  physical address later
+        if( z.nbr_pending < ARP_PENDING_NBR )
+        {
+            z.pending      [z.nbr_pending] = msg;
+            z.pending_entry[z.nbr_pending] = (byte)(p-z.cache);
+            z.nbr_pending++;
+        }
+        else
             msg_free(msg);
 
         // If necessary, kick off an ARP request
         if( p->state == IDLE )
         {
-            msg = pool_idx( &z.pool, (byte)(p-z.cache) );
-            send_request( msg, ipaddr );
-            p->ipaddr = ipaddr;
+            send_request( ipaddr );
             p->state  = WAITING;
             p->retry_count = 0;
             timer_start_seconds( &p->timer, TIMER_RETRY );
@@ -153,8 +214,6 @@ void arp_down( MSG *msg )
 //   OR [arp ethframe] = [dst eth][src eth][FRAME_TYPE_ARP][arp frame]
 void arp_up( MSG *msg )
 {
-    MSG  *reply, *queued;
-    byte oldstate;
 
     // Get message fields
     u16  hw_type             = msg_read2(msg,0);
@@ -180,33 +239,10 @@ void arp_up( MSG *msg )
         // If it's a request, then reply
         CACHE_ENTRY *p = select(sender_ipaddr);
         if( opcode == OPCODE_REQUEST  )
-        {
-            reply = pool_idx( &z.pool, (byte)(p-z.cache) );
-            send_reply( reply, sender_ipaddr, sender_ethaddr );
-        }
+            send_reply( sender_ipaddr, sender_ethaddr );
 
         // Save the info in a BOUND cache entry
-        oldstate  = p->state;
-        p->state  = BOUND;
-        p->ipaddr = sender_ipaddr;
-        memcpy( p->ethaddr, sender_ethaddr, ETHADDR_LEN );
-
-        // Flush BOUND entries regularly
-        timer_start_seconds( &p->timer, TIMER_FLUSH );
-        if( oldstate == WAITING )
-        {
-
-            // If we were WAITING for the physical address,
-            //  we can now dequeue waiting frames and send
-            //  them
-            while( NULL != (queued=mq_read(&p->mq)) )
-            {
-                msg_push2( queued, FRAME_TYPE_IP );
-                msg_push6( queued, config.my_ethaddr );    // src
-                msg_push6( queued, p->ethaddr );           // dst
-                bmz_down( TASKID_ETHER, queued );
-            }
-        }
+        bind( p, sender_ethaddr );
     }
 
     // Free the message
@@ -219,11 +255,20 @@ void arp_up( MSG *msg )
  *************************************************************************/
 void arp_timeout( byte timer_id )
 {
-    CACHE_ENTRY *p = &z.cache[timer_id];
-    MSG *msg;
+    CACHE_ENTRY *p;
 
-    // Flush old entries
-    if( p->state == BOUND )
+    // Gratuitous ARP, a request for our own address
+    if( timer_id == TIMER_ID_ANNOUNCE )
+    {
+        send_request( config.my_ipaddr );
+        if( ++z.announce_count < ANNOUNCE_NBR )
+            timer_start_seconds( &z.timer_announce, ANNOUNCE_INTERVAL );
+        return;
+    }
+    p = &z.cache[timer_id];
+
+    // Flush old entries, and forget old failures
+    if( p->state==BOUND || p->state==FAILED )
         p->state = IDLE;
 
     // Retry if still waiting
@@ -232,27 +277,54 @@ void arp_timeout( byte timer_id )
         if( p->retry_count <= RETRY_LIMIT )
         {
             p->retry_count++;
-            msg = pool_idx( &z.pool, (byte)(p-z.cache) );
-            send_request( msg, p->ipaddr );
+            send_request( p->ipaddr );
             timer_start_seconds( &p->timer, TIMER_RETRY );
         }
 
-        // Give up eventually
+        // Give up eventually, and remember that we did
         else
         {
-            mq_clear( &p->mq );
-            p->state = IDLE;
+            pending_release( p, false );
+            p->state = FAILED;
+            timer_start_seconds( &p->timer, TIMER_FAILED );
         }
     }
 }
 
 
+/*************************************************************************
+ * Learn a binding from a received frame
+ *************************************************************************/
+void arp_learn( IPADDR ipaddr, ETHADDR ethaddr )
+{
+    CACHE_ENTRY *p;
+
+    // Ignore nonsense
+    if( ipaddr==0 || ipaddr==config.my_ipaddr || (ethaddr[0]&0x01) )
+        return;
+
+    // Usually we know it already, leave the flush timer alone in that
+    //  case, the binding will be learnt again soon after it is flushed
+    p = lookup( ipaddr );
+    if( p && 0==memcmp(p->ethaddr,ethaddr,ETHADDR_LEN) )
+        return;
+    if( !p )
+        p = select( ipaddr );
+    bind( p, ethaddr );
+}
+
+
 /*************************************************************************
  * Send an arp request
  *************************************************************************/
-static void send_request( MSG *msg, IPADDR ipaddr )
+static void send_request( IPADDR ipaddr )
 {
-    msg_clear ( msg );
+    MSG *msg = pool_alloc( &z.pool );
+
+    // If all request MSGs are still in use, skip it, the retry timer
+    //  will try again
+    if( !msg )
+        return;
     msg_push2 ( msg, FRAME_TYPE_ARP );      // 2 eth type = ARP
     msg_push6 ( msg, config.my_ethaddr );   // 6 eth src
     msg_push6 ( msg, eth_broadcast  );      // 6 eth dst
@@ -271,10 +343,14 @@ static void send_request( MSG *msg, IPADDR ipaddr )
 /*************************************************************************
  * Send an arp reply
  *************************************************************************/
-static void send_reply( MSG *msg, IPADDR target_ipaddr,
-                                                   ETHADDR target_ethaddr )
+static void send_reply( IPADDR target_ipaddr, ETHADDR target_ethaddr )
 {
-    msg_clear ( msg );
+    MSG *msg = pool_alloc( &z.pool );
+
+    // If all request MSGs are still in use, skip it, the peer will
+    //  ask again
+    if( !msg )
+        return;
     msg_push2 ( msg, FRAME_TYPE_ARP );      // 2 eth type = ARP
     msg_push6 ( msg, config.my_ethaddr );   // 6 eth src
     msg_push6 ( msg, target_ethaddr );      // 6 eth dst
@@ -295,17 +371,29 @@ static void send_reply( MSG *msg, IPADDR target_ipaddr,
  *************************************************************************/
 static CACHE_ENTRY *lookup( IPADDR ipaddr )
 {
-    CACHE_ENTRY *p, *found=NULL;
-    byte i;
-    for( i=0, p=z.cache; i<CACHE_NBR; i++, p++ )
+    CACHE_ENTRY *p=z.last_hit;
+    byte idx;
+
+    // Same as last time ?
+    if( !p || p->state!=BOUND || p->ipaddr!=ipaddr )
     {
-        if( p->state==BOUND && p->ipaddr==ipaddr )
+
+        // No, search hash chain
+        p = NULL;
+        for( idx=z.hash[HASH(ipaddr)]; idx!=NO_ENTRY;
+                                              idx=z.cache[idx].next )
         {
-            found = p;
-            break;
+            if( z.cache[idx].state==BOUND && z.cache[idx].ipaddr==ipaddr )
+            {
+                p = &z.cache[idx];
+                z.last_hit = p;
+                break;
+            }
         }
     }
-    return( found );
+    if( p )
+        p->last_used = tick_get();
+    return( p );
 }
 
 /*************************************************************************
@@ -313,35 +401,28 @@ static CACHE_ENTRY *lookup( IPADDR ipaddr )
  *************************************************************************/
 static CACHE_ENTRY *select( IPADDR ipaddr )
 {
-    CACHE_ENTRY *p, *found=NULL, *idle=NULL, *oldest=NULL,
+    CACHE_ENTRY *p, *found=NULL, *idle=NULL, *failed=NULL, *oldest=NULL,
                                                      *very_reluctant=NULL;
-    u32  time_remaining;
-    u32  min_bound          = (u32)(-1);   //ULONG_MAX
-    byte i, max_retry_count = 0;
+    byte i, idx, max_retry_count = 0;
 
-    // Loop until done or ideal candidate found
-    for( i=0, p=z.cache; !found && i<CACHE_NBR; i++, p++ )
+    // An entry for this IP address is ideal, in any state
+    for( idx=z.hash[HASH(ipaddr)]; idx!=NO_ENTRY; idx=z.cache[idx].next )
     {
+        if( z.cache[idx].ipaddr == ipaddr )
+            return( &z.cache[idx] );
+    }
 
-        // Choose a candidate based on state
+    // Otherwise choose a candidate based on state
+    for( i=0, p=z.cache; i<ARP_CACHE_NBR; i++, p++ )
+    {
         switch( p->state )
         {
 
-            // If bound, a matching candidate is ideal, otherwise
-            //  the oldest one is most desirable
+            // If bound, the least recently used one is most desirable
             case BOUND:
             {
-                if( p->ipaddr == ipaddr )
-                    found = p;
-                else
-                {
-                    time_remaining = timer_read(&p->timer);
-                    if( time_remaining <= min_bound )
-                    {
-                        min_bound = time_remaining;
-                        oldest = p;
-                    }
-                }
+                if( !oldest || (long)(p->last_used-oldest->last_used) < 0 )
+                    oldest = p;
                 break;
             }
 
@@ -353,14 +434,19 @@ static CACHE_ENTRY *select( IPADDR ipaddr )
                 break;
             }
 
-            // If waiting, a matching candidate is ideal, otherwise
-            //  we are very reluctant, but if we must, then choose one
-            //  close to timing out
+            // Then a failed entry, we would only discard frames
+            case FAILED:
+            {
+                if( !failed )
+                    failed = p;
+                break;
+            }
+
+            // If waiting, we are very reluctant, but if we must, then
+            //  choose one close to timing out
             case WAITING:
             {
-                if( p->ipaddr == ipaddr )
-                    found = p;
-                else if( p->retry_count >= max_retry_count )
+                if( p->retry_count >= max_retry_count )
                 {
                     max_retry_count = p->retry_count;
                     very_reluctant = p;
@@ -371,23 +457,113 @@ static CACHE_ENTRY *select( IPADDR ipaddr )
     }
 
     // Pick out the most desirable candidate
-    if( !found )
+    if( idle )
+        found = idle;
+    else if( failed )
+        found = failed;
+    else if( oldest )
+        found = oldest;
+    else
     {
-        if( idle )
-            found = idle;
-        else if( oldest )
-            found = oldest;
+
+        // If we must choose a waiting one, clear it out
+        //  (don't imagine this would ever happen)
+        found = very_reluctant;
+        assert( found );
+        pending_release( found, false );
+    }
+
+    // Move it to the hash chain for its new IP address
+    timer_stop( &found->timer );
+    hash_unlink( found );
+    found->state  = IDLE;
+    found->ipaddr = ipaddr;
+    hash_link( found );
+    return( found );
+}
+
+/*************************************************************************
+ * Bind a cache entry to an ethernet address
+ *************************************************************************/
+static void bind( CACHE_ENTRY *p, ETHADDR ethaddr )
+{
+    byte oldstate = p->state;
+    p->state  = BOUND;
+    p->last_used = tick_get();
+    memcpy( p->ethaddr, ethaddr, ETHADDR_LEN );
+
+    // Flush BOUND entries regularly
+    timer_start_seconds_slack( &p->timer, TIMER_FLUSH, TIMER_FLUSH_SLACK );
+    if( oldstate == WAITING )
+    {
+
+        // If we were WAITING for the physical address,
+        //  we can now dequeue waiting frames and send
+        //  them
+        pending_release( p, true );
+    }
+}
+
+/*************************************************************************
+ * Take a cache entry's frames off the pending queue, send or discard
+ *  them
+ *************************************************************************/
+static void pending_release( CACHE_ENTRY *p, bool send )
+{
+    MSG  *queued;
+    byte i, keep=0, idx=(byte)(p-z.cache);
+
+    // Frames for other entries are kept, in order
+    for( i=0; i<z.nbr_pending; i++ )
+    {
+        queued = z.pending[i];
+        if( z.pending_entry[i] != idx )
+        {
+            z.pending      [keep] = queued;
+            z.pending_entry[keep] = z.pending_entry[i];
+            keep++;
+        }
+        else if( !send )
+            msg_free( queued );
         else
         {
+            msg_push2( queued, FRAME_TYPE_IP );
+            msg_push6( queued, config.my_ethaddr );    // src
+            msg_push6( queued, p->ethaddr );           // dst
+            bmz_down( TASKID_ETHER, queued );
+        }
+    }
+    z.nbr_pending = keep;
+}
+
+/*************************************************************************
+ * Add a cache entry to the hash chain for its IP address
+ *************************************************************************/
+static void hash_link( CACHE_ENTRY *p )
+{
+    byte *head = &z.hash[HASH(p->ipaddr)];
+    p->next = *head;
+    *head   = (byte)(p-z.cache);
+}
 
-            // If we must choose a waiting one, clear it out
-            //  (don't imagine this would ever happen)
-            found = very_reluctant;
-            assert( found );
-            mq_clear( &very_reluctant->mq );
-            timer_stop( &very_reluctant->timer );
-            very_reluctant->state = IDLE;
+/*************************************************************************
+ * Remove a cache entry from the hash chain for its IP address, if it
+ *  is in it
+ *************************************************************************/
+static void hash_unlink( CACHE_ENTRY *p )
+{
+    byte *link = &z.hash[HASH(p->ipaddr)];
+    byte idx   = (byte)(p-z.cache);
+    while( *link != NO_ENTRY )
+    {
+        if( *link == idx )
+        {
+            *link   = p->next;
+            p->next = NO_ENTRY;
+            break;
         }
+        link = &z.cache[*link].next;
     }
-    return( found );
+    if( z.last_hit == p )
+        z.last_hit = NULL;
 }
@@ -2,8 +2,13 @@
 #ifndef  ARP_H
 #define  ARP_H
 #include "bmz.h"
+#include "tcpip.h"
 void *arp_init( byte **addr_mem, u16 *addr_len );
 void arp_down( MSG *msg );
 void arp_up( MSG *msg );
 void arp_timeout( byte timer_id );
+
+// Learn an IP address to ethernet address binding (from a received
+//  frame), saves an ARP request when we send to that address
+void arp_learn( IPADDR ipaddr, ETHADDR ethaddr );
 #endif  // ARP_H
@@ -10,7 +10,7 @@
 #include "console.h"
 
 // Size of task table
-#define MAX_TASKS 10
+#define MAX_TASKS 11
 
 // Entry in the task table
 typedef struct
@@ -201,7 +201,7 @@ void bmz_define_system( const TASK_DESCRIPTOR *td, int td_nbr,
 void bmz_run()
 {
     TASK *p;
-    u32 previous, now, elapsed;
+    u32 previous, now;
     MQ *mq;
     MSG *msg;
     byte i;
@@ -247,12 +247,14 @@ void bmz_run()
                 (*p->idle)();
         }
 
+        // Run hi res timers on every pass
+        timer_run_hi_res();
+
         // If the heartbeat has ticked, run timers
         now = tick_get();
         if( now != previous )
         {
-            elapsed = now-previous;
-            timer_run( elapsed );
+            timer_run( now );
             previous = now;
         }
     }
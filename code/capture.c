@@ -0,0 +1,247 @@
+/*************************************************************************
+ * capture.c
+ *
+ *  In memory capture of ethernet frames, extracted in pcap format
+ *  Project: eZ2944
+ *************************************************************************/
+#include <string.h>
+#include "project.h"
+#include "bmz.h"
+#include "tcpip.h"
+#include "capture.h"
+#ifdef DEBUG_CAPTURE
+
+// Capturing a frame is just a timestamp and a memcpy() into a fixed size
+//  slot of a ring, so it is cheap enough to leave running at full speed.
+//  Converting to pcap format is left until the frames are extracted.
+
+// Read big endian fields from a frame
+#define READ2(p) ( (((u16)(p)[0])<<8) | (u16)(p)[1] )
+
+// pcap file format
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+#define PCAP_LINKTYPE_ETHER 1
+
+// Frames to match, zero fields match anything
+typedef struct
+{
+    u16  frame_type;
+    byte protocol;
+    u16  port;
+} MATCH;
+
+// One captured frame
+typedef struct
+{
+    u32  timestamp;     // hi res ticks
+    u16  len;           // original length
+    u16  caplen;        // length kept
+    byte data[CAPTURE_SNAPLEN_MAX];
+} SLOT;
+
+// Module data
+typedef struct
+{
+    SLOT  ring[CAPTURE_NBR];
+    byte  put;          // next slot to write
+    byte  nbr;          // nbr of slots written
+    u16   snaplen;      // 0 means CAPTURE_SNAPLEN_MAX
+    MATCH filter;
+    MATCH trigger;
+    bool  trigger_set;
+    bool  triggered;
+    byte  post_count;   // frames to capture after trigger
+    byte  remaining;    // frames left to capture after trigger
+    bool  frozen;       // not capturing
+} CAPTURE;
+static CAPTURE z;
+
+// Local prototypes
+static bool match( const MATCH *m, const byte *frame, u16 len );
+static void put2( byte *p, u16 dat );
+static void put4( byte *p, u32 dat );
+
+/*************************************************************************
+ * Record a frame
+ *************************************************************************/
+void capture_frame( const byte *frame, u16 len )
+{
+    SLOT *slot;
+    u16  caplen;
+    if( z.frozen || !match(&z.filter,frame,len) )
+        return;
+
+    // Overwrite the oldest slot once the ring is full
+    slot = &z.ring[z.put];
+    slot->timestamp = tick_get_hi_res();
+    slot->len       = len;
+    caplen = (z.snaplen ? z.snaplen : CAPTURE_SNAPLEN_MAX);
+    if( caplen > len )
+        caplen = len;
+    slot->caplen    = caplen;
+    memcpy( slot->data, frame, caplen );
+    if( ++z.put == CAPTURE_NBR )
+        z.put = 0;
+    if( z.nbr < CAPTURE_NBR )
+        z.nbr++;
+
+    // Freeze post_count frames after the trigger
+    if( z.triggered )
+    {
+        if( --z.remaining == 0 )
+            z.frozen = true;
+    }
+    else if( z.trigger_set && match(&z.trigger,frame,len) )
+    {
+        z.triggered = true;
+        z.remaining = z.post_count;
+        if( z.remaining == 0 )
+            z.frozen = true;
+    }
+}
+
+/*************************************************************************
+ * Set nbr of bytes kept per frame
+ *************************************************************************/
+void capture_set_snaplen( u16 snaplen )
+{
+    if( snaplen > CAPTURE_SNAPLEN_MAX )
+        snaplen = CAPTURE_SNAPLEN_MAX;
+    z.snaplen = snaplen;
+}
+
+/*************************************************************************
+ * Only capture frames that match
+ *************************************************************************/
+void capture_set_filter( u16 frame_type, byte protocol, u16 port )
+{
+    z.filter.frame_type = frame_type;
+    z.filter.protocol   = protocol;
+    z.filter.port       = port;
+}
+
+/*************************************************************************
+ * Stop capturing post_count frames after a frame matching the trigger
+ *************************************************************************/
+void capture_set_trigger( u16 frame_type, byte protocol, u16 port,
+                                                      byte post_count )
+{
+    z.trigger.frame_type = frame_type;
+    z.trigger.protocol   = protocol;
+    z.trigger.port       = port;
+    z.post_count         = post_count;
+    z.trigger_set        = true;
+    capture_clear();
+}
+
+/*************************************************************************
+ * Empty the ring and restart capturing
+ *************************************************************************/
+void capture_clear()
+{
+    z.put       = 0;
+    z.nbr       = 0;
+    z.triggered = false;
+    z.frozen    = false;
+}
+
+/*************************************************************************
+ * Write ring contents as a pcap file
+ *************************************************************************/
+void capture_extract( void (*write)( const byte *buf, u16 len ) )
+{
+    byte hdr[24];
+    byte i, idx;
+    bool frozen = z.frozen;
+    SLOT *slot;
+    u32  rem;
+
+    // Don't capture while we are extracting
+    z.frozen = true;
+
+    // File header, written little endian
+    put4( hdr,    PCAP_MAGIC );
+    put2( hdr+4,  PCAP_VERSION_MAJOR );
+    put2( hdr+6,  PCAP_VERSION_MINOR );
+    put4( hdr+8,  0 );                      // timezone
+    put4( hdr+12, 0 );                      // timestamp accuracy
+    put4( hdr+16, CAPTURE_SNAPLEN_MAX );    // snaplen
+    put4( hdr+20, PCAP_LINKTYPE_ETHER );
+    (*write)( hdr, 24 );
+
+    // Frames, oldest first
+    idx = (z.put + CAPTURE_NBR - z.nbr) % CAPTURE_NBR;
+    for( i=0; i<z.nbr; i++ )
+    {
+        slot = &z.ring[idx];
+
+        // Split hi res ticks into seconds and microseconds. Note that
+        //  1000000/TICKS_PER_SECOND_HI_RES = 5 + 1170/9766 exactly, which
+        //  avoids overflowing 32 bits
+        rem = slot->timestamp % TICKS_PER_SECOND_HI_RES;
+        put4( hdr,    slot->timestamp / TICKS_PER_SECOND_HI_RES );
+        put4( hdr+4,  5*rem + (rem*1170)/9766 );
+        put4( hdr+8,  slot->caplen );
+        put4( hdr+12, slot->len );
+        (*write)( hdr, 16 );
+        (*write)( slot->data, slot->caplen );
+        if( ++idx == CAPTURE_NBR )
+            idx = 0;
+    }
+    z.frozen = frozen;
+}
+
+/*************************************************************************
+ * Test whether a frame matches
+ *************************************************************************/
+static bool match( const MATCH *m, const byte *frame, u16 len )
+{
+    const byte *ip = frame + ETH_OFFSET;
+    byte hlen;
+    if( m->frame_type && m->frame_type!=READ2(frame+ETH_OFFSET-2) )
+        return( false );
+    if( m->protocol || m->port )
+    {
+        if( READ2(frame+ETH_OFFSET-2)!=FRAME_TYPE_IP ||
+            len < ETH_OFFSET+20
+          )
+            return( false );
+        if( m->protocol && m->protocol!=ip[9] )
+            return( false );
+        if( m->port )
+        {
+            // Ports are only in the first fragment of TCP and UDP
+            hlen = (ip[0]&0x0f) << 2;
+            if( (ip[9]!=PROTOCOL_TCP && ip[9]!=PROTOCOL_UDP) ||
+                (READ2(ip+6)&0x1fff)!=0 ||
+                len < ETH_OFFSET+hlen+4
+              )
+                return( false );
+            if( READ2(ip+hlen)!=m->port && READ2(ip+hlen+2)!=m->port )
+                return( false );
+        }
+    }
+    return( true );
+}
+
+/*************************************************************************
+ * Write little endian u16
+ *************************************************************************/
+static void put2( byte *p, u16 dat )
+{
+    p[0] = (byte)dat;
+    p[1] = (byte)(dat>>8);
+}
+
+/*************************************************************************
+ * Write little endian u32
+ *************************************************************************/
+static void put4( byte *p, u32 dat )
+{
+    put2( p,   (u16)dat );
+    put2( p+2, (u16)(dat>>16) );
+}
+
+#endif // DEBUG_CAPTURE
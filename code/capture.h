@@ -0,0 +1,37 @@
+/*************************************************************************
+ * capture.h
+ *
+ *  In memory capture of ethernet frames, extracted in pcap format
+ *  Project: eZ2944
+ *************************************************************************/
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include "bmz.h"
+
+// Capture ring size (costs CAPTURE_NBR * (CAPTURE_SNAPLEN_MAX+8) bytes)
+#define CAPTURE_NBR          8      // nbr of frames kept
+#define CAPTURE_SNAPLEN_MAX  128    // max bytes kept per frame
+
+// Record a frame (complete ethernet frame, without CRC)
+void capture_frame( const byte *frame, u16 len );
+
+// Set nbr of bytes kept per frame (max CAPTURE_SNAPLEN_MAX)
+void capture_set_snaplen( u16 snaplen );
+
+// Only capture frames that match, zero fields match anything, port
+//  matches either the src or dst TCP/UDP port
+void capture_set_filter( u16 frame_type, byte protocol, u16 port );
+
+// Stop capturing post_count frames after a frame matching the trigger
+//  (fields as for the filter), so the ring holds the lead up to the
+//  trigger frame
+void capture_set_trigger( u16 frame_type, byte protocol, u16 port,
+                                                      byte post_count );
+
+// Empty the ring and restart capturing (rearms the trigger)
+void capture_clear();
+
+// Write ring contents, oldest frame first, as a pcap file
+void capture_extract( void (*write)( const byte *buf, u16 len ) );
+
+#endif  // CAPTURE_H
@@ -7,6 +7,29 @@
 #include <stdio.h>
 #include "choices.h"
 #include "checksum.h"
+#if defined(CHECKSUM_SIMD) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// The checksum is the ones complement of the ones complement sum of the
+//  data as 16 bit words. We add the words into a 32 bit sum (which can't
+//  overflow for any length we can be given) and fold the carries back in
+//  at the end, which gives the same result. The main loop adds 8 words
+//  per pass, to cut loop overhead. On a PC hosted build CHECKSUM_SIMD
+//  (see choices.h) uses SSE2 or AVX2 to add many words at once.
+
+// Checksums can also be built up from partial sums, 32 bit sums that
+//  haven't been folded. A partial sum of data can be calculated while
+//  copying it (checksum_copy()), so data only needs to be read once, and
+//  added to the partial sum of headers when they are added later.
+
+// Headers that are mostly the same from one datagram to the next needn't
+//  be summed from memory at all. The sum of their fields as 16 bit
+//  values can be kept, and only the fields that change added each time.
+//  Such a sum is of big endian values, checksum_host() converts it to
+//  or from a partial sum of data in memory. And when a header that
+//  already has a checksum is changed, checksum_adjust() corrects the
+//  checksum without summing anything (RFC 1624).
 
 /*************************************************************************
  * Calculate checksum (for transmit)
@@ -16,22 +39,122 @@
 //  In both cases, the memory operation must be a
 //  *native* big endian or little endian read or write
 u16 checksum_calculate( const byte *data, u16 len )
+{
+    return( checksum_fold( checksum_partial(data,len) ) );
+}
+
+
+/*************************************************************************
+ * Test checksum (for receive)
+ *************************************************************************/
+// The checksum field is skipped, rather than temporarily zeroed, so the
+//  data is only read. Checksum fields are always at an even offset, so
+//  the words either side of the field pair up as before.
+bool checksum_test( const byte *data, u16 len, u16 offset )
+{
+    bool err=true;
+    u16 existing, calculated;
+
+    // Too short to hold the checksum field is an error (and len-offset-2
+    //  below would wrap)
+    if( len < offset+2 )
+    {
+        printf( "Checksum error !" );
+        return( err );
+    }
+
+    // Get existing value in native order
+    existing = *(const u16 *)&data[offset];
+
+    // Existing value == 0 is a special case
+    if( existing == 0 )
+        err = false;
+    else
+    {
+
+        // Calculate checksum, as if checksum field were zero
+        calculated = checksum_fold( checksum_partial( data, offset ) +
+                            checksum_partial( data+offset+2, len-offset-2 ) );
+
+        // Does it match existing value ?
+        err = (calculated!=existing);
+        if( err )
+            printf( "Checksum error !" );
+    }
+    return( err );
+}
+
+
+/*************************************************************************
+ * Calculate partial sum, data added as 16 bit words without folding
+ *  carries
+ *************************************************************************/
+u32 checksum_partial( const byte *data, u16 len )
 {
     byte end[2];
     u32  sum;
     const u16 *p;
     u16 nbr_pairs;
     bool odd = ( (len&1) ? true : false );
+    #if defined(CHECKSUM_SIMD) && defined(__AVX2__)
+    __m256i acc, zero, v;
+    __m128i acc128;
+    #elif defined(CHECKSUM_SIMD) && defined(__SSE2__)
+    __m128i acc, zero, v;
+    #endif
 
     // Get number of byte pairs, up to but not including possible odd byte
     //  at end (so round down)
     nbr_pairs = len>>1;
 
-    // Checksumming loop - Magic trick optimisation below means we can
+    // Summing loop - Magic trick optimisation below means we can
     //  access 16 bit data as *p, without worrying about big/little
     //  endian issues.
     sum = 0;
     p   = (const u16 *)data;
+
+    // Many words at a time, widened to 32 bit lanes
+    #if defined(CHECKSUM_SIMD) && defined(__AVX2__)
+    acc  = _mm256_setzero_si256();
+    zero = _mm256_setzero_si256();
+    while( nbr_pairs >= 16 )
+    {
+        v   = _mm256_loadu_si256( (const __m256i *)p );
+        acc = _mm256_add_epi32( acc, _mm256_unpacklo_epi16(v,zero) );
+        acc = _mm256_add_epi32( acc, _mm256_unpackhi_epi16(v,zero) );
+        p  += 16;
+        nbr_pairs -= 16;
+    }
+    acc128 = _mm_add_epi32( _mm256_castsi256_si128(acc),
+                            _mm256_extracti128_si256(acc,1) );
+    acc128 = _mm_add_epi32( acc128, _mm_shuffle_epi32(acc128,0x4e) );
+    acc128 = _mm_add_epi32( acc128, _mm_shuffle_epi32(acc128,0xb1) );
+    sum = (u32)(unsigned int)_mm_cvtsi128_si32( acc128 );
+    #elif defined(CHECKSUM_SIMD) && defined(__SSE2__)
+    acc  = _mm_setzero_si128();
+    zero = _mm_setzero_si128();
+    while( nbr_pairs >= 8 )
+    {
+        v   = _mm_loadu_si128( (const __m128i *)p );
+        acc = _mm_add_epi32( acc, _mm_unpacklo_epi16(v,zero) );
+        acc = _mm_add_epi32( acc, _mm_unpackhi_epi16(v,zero) );
+        p  += 8;
+        nbr_pairs -= 8;
+    }
+    acc = _mm_add_epi32( acc, _mm_shuffle_epi32(acc,0x4e) );  // add lanes
+    acc = _mm_add_epi32( acc, _mm_shuffle_epi32(acc,0xb1) );
+    sum = (u32)(unsigned int)_mm_cvtsi128_si32( acc );
+    #endif
+
+    // 8 words at a time
+    while( nbr_pairs >= 8 )
+    {
+        sum += (u32)p[0] + p[1] + p[2] + p[3] + p[4] + p[5] + p[6] + p[7];
+        p   += 8;
+        nbr_pairs -= 8;
+    }
+
+    // Remaining words
     while( nbr_pairs-- )
     {
         sum += (u32)(*p);
@@ -46,7 +169,70 @@ u16 checksum_calculate( const byte *data, u16 len )
         p   = (const u16 *)end;
         sum += (u32)(*p);
     }
+    return( sum );
+}
+
+
+/*************************************************************************
+ * Copy data and calculate its partial sum
+ *************************************************************************/
+u32 checksum_copy( byte *dst, const byte *src, u16 len )
+{
+    byte end[2];
+    u32  sum=0;
+    const u16 *p = (const u16 *)src;
+    u16  *q = (u16 *)dst;
+    u16  nbr_pairs = len>>1;
+
+    // 4 words at a time
+    while( nbr_pairs >= 4 )
+    {
+        sum += (u32)(q[0]=p[0]) + (q[1]=p[1]) + (q[2]=p[2]) + (q[3]=p[3]);
+        p += 4;
+        q += 4;
+        nbr_pairs -= 4;
+    }
 
+    // Remaining words
+    while( nbr_pairs-- )
+        sum += (u32)(*q++ = *p++);
+
+    // If odd, copy odd byte at end and add it plus padding zero
+    if( len & 1 )
+    {
+        end[0] = dst[len-1] = src[len-1];
+        end[1] = 0;
+        sum += (u32)(*(const u16 *)end);
+    }
+    return( sum );
+}
+
+
+/*************************************************************************
+ * Combine partial sums, sum2 is the partial sum of data that follows
+ *  offset bytes after the start of the data in sum
+ *************************************************************************/
+u32 checksum_combine( u32 sum, u32 sum2, u16 offset )
+{
+    // If sum2's data starts at an odd offset, its bytes are paired
+    //  wrongly. Swapping the bytes of the (folded) sum puts that right,
+    //  in either byte order.
+    if( offset & 1 )
+    {
+        sum2 = (sum2 >> 16) + (sum2 & 0xffff);
+        sum2 += (sum2 >> 16);
+        sum2 &= 0xffff;
+        sum2 = ((sum2<<8) | (sum2>>8)) & 0xffff;
+    }
+    return( sum + sum2 );
+}
+
+
+/*************************************************************************
+ * Fold partial sum into a checksum, ready to poke into memory
+ *************************************************************************/
+u16 checksum_fold( u32 sum )
+{
     // A well known but mysterious (at least to me) magic trick to get the
     //  right answer (in the sense described in the intro) on big endian
     //  and little endian machines
@@ -58,37 +244,29 @@ u16 checksum_calculate( const byte *data, u16 len )
 
 
 /*************************************************************************
- * Test checksum (for receive)
+ * Convert between a partial sum of data in memory and a sum of the same
+ *  16 bit words as (big endian) values
  *************************************************************************/
-bool checksum_test(  byte *data, u16 len, u16 offset )
+// Nothing changes on a big endian machine, on a little endian machine
+//  the bytes of the folded sum are swapped, so the conversion works in
+//  either direction
+u32 checksum_host( u32 sum )
 {
-    bool err=true;
-    u16 *p;
-    u16 existing, calculated;
-
-    // Get ptr to the checksum field
-    p = (u16 *)&data[offset];
-
-    // Get existing value in native order
-    existing  = *p;
-
-    // Existing value == 0 is a special case
-    if( existing == 0 )
-        err = false;
-    else
-    {
+    byte buf[2];
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    *(u16 *)buf = (u16)sum;     // native write
+    return( (((u32)buf[0])<<8) | (u32)buf[1] );
+}
 
-        // Calculate checksum, with zero value temporarily in checksum
-        //  field
-        *p     = 0;
-        calculated = checksum_calculate( data, len );
-        *p     = existing;
 
-        // Does it match existing value ?
-        err = (calculated!=existing);
-        if( err )
-            printf( "Checksum error !" );
-    }
-    return( err );
+/*************************************************************************
+ * Adjust an existing checksum after a 16 bit word changes from old to new
+ *************************************************************************/
+// RFC 1624 eqn 3, HC' = ~(~HC + ~m + m'). The checksum and words can
+//  either all be native reads from memory or all be big endian values.
+u16 checksum_adjust( u16 checksum, u16 old, u16 new )
+{
+    u32 sum = (u32)(0xffff^checksum) + (u32)(0xffff^old) + (u32)new;
+    return( checksum_fold(sum) );
 }
-
@@ -3,5 +3,11 @@
 #define  CHECKSUM_H
 #include "types.h"
 u16 checksum_calculate( const byte *data, u16 len );
-bool checksum_test(  byte *data, u16 len, u16 offset );
+bool checksum_test( const byte *data, u16 len, u16 offset );
+u32 checksum_partial( const byte *data, u16 len );
+u32 checksum_copy( byte *dst, const byte *src, u16 len );
+u32 checksum_combine( u32 sum, u32 sum2, u16 offset );
+u16 checksum_fold( u32 sum );
+u32 checksum_host( u32 sum );
+u16 checksum_adjust( u16 checksum, u16 old, u16 new );
 #endif  // CHECKSUM_H
@@ -24,6 +24,19 @@
 // Leave defined to discard occasional RX frames for testing
 // #define DEBUG_RX_DISCARD
 
+// Leave defined to keep an in memory capture of TX and RX frames, that
+//  can be extracted in pcap format (see capture.h, costs about 1K RAM)
+// #define DEBUG_CAPTURE
+
+// Leave defined for single key debug commands on the console (see
+//  console_poll() in console.c). The console UART's input then goes to
+//  the commands instead of the first tserver.
+// #define DEBUG_CONSOLE
+
+// Leave defined to use SSE2/AVX2 (whichever the compiler targets) for
+//  checksums, PC hosted builds only
+// #define CHECKSUM_SIMD
+
 // Leave defined to enable the DBG() debugging function
 // #define DEBUG_DBG
 
@@ -6,10 +6,14 @@
  *************************************************************************/
 #include "bmz.h"
 #include "uart.h"
+#include "ether.h"
+#include "capture.h"
 #include "console.h"
 
-// Which UART are we using ?
-#define CONSOLE_UART 0
+// Local prototypes
+#ifdef DEBUG_CONSOLE
+static void put_hex( const byte *buf, u16 len );
+#endif
 
 /*************************************************************************
  * Setup UART if necessary
@@ -105,3 +109,74 @@ void putu32( u32 n )
     if( !nonzero )
         putch( '0' );
 }
+
+
+/*************************************************************************
+ * Single key debug commands, call regularly
+ *************************************************************************/
+#ifdef DEBUG_CONSOLE
+void console_poll()
+{
+    if( !kbhit() )
+        return;
+    switch( getch() )
+    {
+
+        // Ethernet driver statistics
+        case 's':
+        {
+            ether_show_stats();
+            break;
+        }
+        case 'z':
+        {
+            ether_clear_stats();
+            putstr( "stats cleared\n" );
+            break;
+        }
+        #ifdef DEBUG_CAPTURE
+
+        // Dump the capture ring as a pcap file in hex, paste the lines
+        //  between the markers into "xxd -r -p" to get the file back
+        case 'p':
+        {
+            putstr( "\n--- pcap start\n" );
+            capture_extract( put_hex );
+            putstr( "--- pcap end\n" );
+            break;
+        }
+
+        // Empty the capture ring and restart capturing
+        case 'c':
+        {
+            capture_clear();
+            putstr( "capture cleared\n" );
+            break;
+        }
+        #endif
+        default:
+        {
+            putstr( "s=show ether stats, z=zero ether stats\n" );
+            #ifdef DEBUG_CAPTURE
+            putstr( "p=dump capture (pcap in hex), c=clear capture\n" );
+            #endif
+            break;
+        }
+    }
+}
+
+/*************************************************************************
+ * Write bytes as hex, one line per call
+ *************************************************************************/
+static void put_hex( const byte *buf, u16 len )
+{
+    static const char hex[] = "0123456789abcdef";
+    while( len-- )
+    {
+        putch( hex[*buf>>4] );
+        putch( hex[*buf&0x0f] );
+        buf++;
+    }
+    putch( '\n' );
+}
+#endif
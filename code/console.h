@@ -7,5 +7,11 @@ unsigned char getch( void );
 unsigned char getche( void );
 void putstr( const char *s );
 void putu32( u32 n );
+
+// Which UART are we using ?
+#define CONSOLE_UART 0
+
+// Single key debug commands, call regularly (if DEBUG_CONSOLE)
+void console_poll();
 #endif  // CONSOLE_H
 
@@ -12,6 +12,8 @@
 #include "tcpip.h"
 #include "console.h"
 #include "ether.h"
+#include "capture.h"
+#include "arp.h"
 
 // TX descriptor flags
 #define EMAC_OWNS       0x8000   // 1=mac owns
@@ -77,6 +79,27 @@ typedef struct
 #define EMAC_SRAM_OFFSET               0xC000
 #define MAXFRAMESIZE                   1514
 #define MINFRAMESIZE                   60
+#define EMAC_RX_IVECT                  0x40
+#define EMAC_TX_IVECT                  0x44
+#define RX_BATCH                       8    // max frames per ether_idle()
+#define FILTER_NBR                     8    // rx filter table entries
+#define STD_IP_HEADER_LEN              20
+#define TX_PENDING_DEPTH               DEFAULT_MQ_DEPTH
+
+// Read big endian fields from a frame
+#define READ2(p) ( (((u16)(p)[0])<<8) | (u16)(p)[1] )
+#define READ4(p) ( (((u32)READ2(p))<<16) | (u32)READ2((p)+2) )
+
+// Receive filter entry, frames that match are sent up to taskid
+typedef struct
+{
+    u16    frame_type;
+    byte   protocol;    // IP protocol, or ETHER_FILTER_ANY
+    byte   flags;
+    u16    port_lo;     // range of TCP/UDP dst ports, 0-0xffff for any
+    u16    port_hi;
+    TASKID taskid;      // TASKID_NULL if entry is free
+} FILTER;
 
 // Module variables
 typedef struct
@@ -84,12 +107,27 @@ typedef struct
     // Status
     bool link_operational;
 
+    // Set by interrupts, cleared by ether_idle() when it has done the work
+    volatile bool rx_event;
+    volatile bool tx_event;
+    u32  poll_tick; // fallback poll in case an event is missed
+
     // Retry timer
     TIMER timer;
 
+    // Frames waiting for room in the tx ring
+    MQ   pending;
+    byte nbr_pending;
+
+    // Receive filter table
+    FILTER filter[FILTER_NBR];
+
+    // Statistics
+    ETHER_STATS stats;
+
     // Location of internal EMAC SRAM
     byte *emac_sram_base;
-    byte *wrap; // store a wrapped rx frame at top of memory
+    byte *mirror;   // tail of a wrapped rx frame is copied here
 
     // SW pointers into EMAC SRAM, match HW equivalents
     byte *twp;
@@ -119,7 +157,17 @@ static void say( const char *s );
 static void phy_write( u16 reg, u16 data );
 static u16  phy_read( u16 reg );
 static bool link_init();
+static byte *read_rwp();
+static byte *read_trp();
+static u16  rx_room( byte *rwp );
+static void show_stat( const char *txt, u32 n );
+static bool tx_frame( MSG *msg );
+static void tx_drain();
+static void rx_frame( byte *rwp );
+static TASKID demux( const byte *frame, u16 len );
 static void show( MSG *msg, bool rx );
+void interrupt emacisr_rx( void );
+void interrupt emacisr_tx( void );
 
 /*************************************************************************
  * Init
@@ -156,20 +204,32 @@ void *ether_init( byte **addr_mem, u16 *addr_len )
     EMAC_TPTV_H = 0x00;
 
     // Define EMAC SRAM region sizes
-    #define REGION_WRAP_SIZE 0x600      // one max sized RX frame, aligned
-    #define REGION_TX_SIZE   672        // largest tx frame we send = 576,
-                                        //  aligned and with a margin
+    //  Note: The MIRROR region is as big as the old WRAP region, so it
+    //  reclaims no SRAM, and a frame that wraps just after its header
+    //  still costs a copy of most of a max sized frame. The EMAC, not
+    //  us, decides where each frame starts, and the TX region sits
+    //  directly in front of the RX region, so neither realigning the
+    //  ring nor copying a wrapped frame's head instead is possible.
+    //  Only a scatter MSG would avoid the copy.
+    #define REGION_MIRROR_SIZE 0x600    // tail of a max sized RX frame,
+                                        //  aligned
+    #define REGION_TX_FRAME  640        // largest tx frame we send = 576,
+                                        //  plus headers, aligned and with
+                                        //  a margin
+    #define REGION_TX_SIZE   (3*REGION_TX_FRAME)
 
     // Set EMAC SRAM boundary ptrs to divide SRAM into regions
-    z.wrap = z.emac_sram_base;          // WRAP region, allow room for a copy
-                                        //  of one max sized RX frame that
-                                        //  would otherwise be wrapped
-    z.tlbp = z.emac_sram_base +         // TX region
-                 REGION_WRAP_SIZE;
+    z.tlbp = z.emac_sram_base;          // TX region
     z.rhbp = z.emac_sram_base +         // bottom, end of RX region
-                 EMAC_SRAM_SIZE;
-
-    // Only need room for one max size frame in tx region
+                 EMAC_SRAM_SIZE - REGION_MIRROR_SIZE;
+    z.mirror = z.rhbp;                  // MIRROR region, immediately
+                                        //  follows the RX region, so a
+                                        //  wrapped frame's tail can be
+                                        //  copied here to make the frame
+                                        //  contiguous
+
+    // Room for several max size frames in tx region, so that back to
+    //  back frames can be queued to the EMAC
     z.bp   = z.tlbp + REGION_TX_SIZE;
     z.bp   = ALIGN32(z.bp);
 
@@ -191,6 +251,22 @@ void *ether_init( byte **addr_mem, u16 *addr_len )
     // Host owns first buffer
     ((DESC *)z.twp)->flags = 0x0000;
 
+    // Clear statistics
+    ether_clear_stats();
+
+    // Default receive filters, the protocols the stack handles
+    memset( z.filter, 0, sizeof(z.filter) );
+    ether_filter_add( FRAME_TYPE_ARP, ETHER_FILTER_ANY, 0, 0xffff,
+                                     ETHER_FILTER_BROADCAST, TASKID_ARP );
+    ether_filter_add( FRAME_TYPE_IP, PROTOCOL_TCP, 0, 0xffff, 0,
+                                                             TASKID_IP );
+    ether_filter_add( FRAME_TYPE_IP, PROTOCOL_ICMP, 0, 0xffff, 0,
+                                                             TASKID_IP );
+
+    // Queue for frames waiting for room in the tx ring
+    mq_init( &z.pending, addr_mem, addr_len, TX_PENDING_DEPTH );
+    z.nbr_pending = 0;
+
     // Set polling timer for minimum timeout period
     EMAC_PTMR = 1;
 
@@ -234,14 +310,17 @@ void *ether_init( byte **addr_mem, u16 *addr_len )
         bmz_set_publish_state( PUBLISH_OTHER );
     }
 
-    // Setup EMAC interrupts (currently not needed)
-    //#define EMAC_RX_IVECT 0x40
-    //#define EMAC_TX_IVECT 0x44
-    //set_vector( EMAC_RX_IVECT, emacisr_rx );
-    //set_vector( EMAC_TX_IVECT, emacisr_tx );
+    // Setup EMAC interrupts, they just flag that there is work for
+    //  ether_idle() to do
+    z.rx_event  = true;
+    z.tx_event  = true;
+    z.poll_tick = tick_get();
+    set_vector( EMAC_RX_IVECT, emacisr_rx );
+    set_vector( EMAC_TX_IVECT, emacisr_tx );
 
-    // Enable required interrupts (currently none)
-    EMAC_IEN = 0;
+    // Enable required interrupts, rx done and tx done
+    EMAC_ISTAT = 0xff;
+    EMAC_IEN = RXDONE_IEN | TXDONE_IEN;
     return( &z );
 }
 
@@ -266,13 +345,6 @@ void ether_timeout( byte timer_id )
  *************************************************************************/
 void ether_down( MSG *msg )
 {
-    DESC *desc;
-    byte *np, *dst, *src;
-    u16   len, phase1;
-    bool  okay=false;
-    byte lo, hi, lo2, hi2;
-    byte *trp;
-
     // Pad message to 60 bytes (not strictly needed as EMAC pads in hardware)
     if( msg_len(msg) < MINFRAMESIZE )
     {
@@ -303,220 +375,497 @@ void ether_down( MSG *msg )
     }
     #endif
 
-    // Wait for hardware TRP to catch twp
-    while( z.link_operational )
+    // Capture frame
+    #ifdef DEBUG_CAPTURE
+    capture_frame( msg_ptr(msg), msg_len(msg) );
+    #endif
+
+    // Discard if too long, it would never fit in the HW tx ring and
+    //  would block the pending queue forever
+    if( msg_len(msg) > MAXFRAMESIZE )
+    {
+        z.stats.tx_drop_length++;
+        msg_free(msg);
+    }
+
+    // Discard if link is down
+    else if( !z.link_operational )
+    {
+        z.stats.tx_drop_link_down++;
+        msg_free(msg);
+    }
+
+    // Write to HW tx ring if there is room. Never wait for room, instead
+    //  queue the frame and let ether_idle() send it when the EMAC has
+    //  caught up. If frames are already queued, join the end of the queue
+    //  so frames go out in order.
+    else if( z.nbr_pending || !tx_frame(msg) )
     {
-        do
+        if( mq_write( &z.pending, msg ) )
         {
-            lo  = EMAC_TRP_L;
-            hi  = EMAC_TRP_H;
-            lo2 = EMAC_TRP_L;
-            hi2 = EMAC_TRP_H;
+            z.nbr_pending++;
+            z.stats.tx_stalls++;
         }
-        while( lo!=lo2 || hi!=hi2 );
-        trp = z.emac_sram_base  +  lo  +  ( ((u16)hi) << 8 );
-        if( z.twp == trp )
+        else
         {
-            okay = true;
-            break;
+            z.stats.tx_drop_queue_full++;
+            msg_free(msg);  // queue full, discard
         }
     }
+}
+
+/*************************************************************************
+ * Write frame to HW tx ring buffer, returns false if there is no room
+ *************************************************************************/
+static bool tx_frame( MSG *msg )
+{
+    DESC *desc;
+    byte *np, *dst, *src, *trp;
+    u16   len, phase1, need, room;
+
+    // Find room between our twp and the hardware TRP (the frames in
+    //  between are waiting to be transmitted). Insist on more room than
+    //  the frame needs, so that twp never catches up with TRP (which
+    //  would look like an empty ring) and there is always room for the
+    //  next descriptor.
+    trp  = read_trp();
+    len  = msg_len(msg);
+    need = (sizeof(DESC) + len + (ALIGN-1)) & ~(ALIGN-1);
+    if( z.twp >= trp )
+        room = (z.bp-z.tlbp) - (z.twp-trp);
+    else
+        room = trp - z.twp;
+    if( need >= room )
+        return( false );
     //DBG printf( "z.twp = %08lx\n", (u32) z.twp );
     //DBG printf( "TRP = %08lx\n", (u32) trp );
 
-    // If not discarding, write to HW tx buffer
-    if( okay )
+    // Assert that we own the descriptor
+    desc = (DESC *)z.twp;
+    assert( !(desc->flags & EMAC_OWNS) );
+
+    // Calculate the next pointer
+    np = z.twp + sizeof(DESC) + len;
+    np = ALIGN32(np);
+    if( np >= z.bp )  // check if we have wrapped
+    {
+        //DBG printf( "TX wrap 1, %u\n", (u16) (np-z.bp) );
+        np = z.tlbp + (np-z.bp);
+    }
+    desc->np = np;      // note that np is at least 32 bytes from bp,
+                        //  because ALIGN32 aligns it to a 32 byte
+                        //  boundary (so can write a DESC at np without
+                        //  fear of overrunning bp)
+
+    // Set the packet size
+    desc->len = len;
+
+    // Move the data to the EMAC SRAM TX ring buffer
+    dst    = z.twp + sizeof(DESC);
+    src    = msg_ptr(msg);
+    phase1 = z.bp-dst;
+    if( len <= phase1 )
+        memcpy( dst, src, len );
+    else
     {
+        //DBG printf( "TX wrap 2, %u\n", (u16) (len-phase1) );
+        memcpy( dst, src, phase1 );
+        memcpy( z.tlbp, src+phase1, len-phase1 );
+    }
+
+    // Update twp, HW TRP will catch up when the frame is TXed
+    z.twp = np;
+    //DBG printf( "Updated z.twp = %08lx\n", (u32) z.twp );
 
-        // Assert that we own the descriptor
-        desc = (DESC *)z.twp;
-        assert( !(desc->flags & EMAC_OWNS) );
+    // To queue one packet for transmission, set next packet to HOST_OWNS,
+    //  this packet to EMAC_OWNS. The EMAC follows the chain, so several
+    //  packets can be queued this way.
+    ((DESC *)np)->flags = HOST_OWNS;
+    desc->flags = EMAC_OWNS;
+    z.stats.tx_frames++;
+    z.stats.tx_bytes += len;
 
-        // Calculate the next pointer
-        np = z.twp + sizeof(DESC) + msg_len(msg);
-        np = ALIGN32(np);
-        if( np >= z.bp )  // check if we have wrapped
+    // Free msg
+    msg_free(msg);
+    return( true );
+}
+
+/*************************************************************************
+ * Send queued frames as room becomes available in HW tx ring buffer
+ *************************************************************************/
+static void tx_drain()
+{
+    MSG *msg;
+    while( z.nbr_pending )
+    {
+        msg = mq_read( &z.pending );
+        if( !z.link_operational )
         {
-            //DBG printf( "TX wrap 1, %u\n", (u16) (np-z.bp) );
-            np = z.tlbp + (np-z.bp);
+            z.stats.tx_drop_link_down++;
+            msg_free(msg);
         }
-        desc->np = np;      // note that np is at least 32 bytes from bp,
-                            //  because ALIGN32 aligns it to a 32 byte
-                            //  boundary (so can write a DESC at np without
-                            //  fear of overrunning bp)
-
-        // Set the packet size
-        len = msg_len(msg);
-        desc->len = len;
-
-        // Move the data to the EMAC SRAM TX ring buffer
-        dst    = z.twp + sizeof(DESC);
-        src    = msg_ptr(msg);
-        phase1 = z.bp-dst;
-        if( len <= phase1 )
-            memcpy( dst, src, len );
-        else
+        else if( !tx_frame(msg) )
         {
-            //DBG printf( "TX wrap 2, %u\n", (u16) (len-phase1) );
-            memcpy( dst, src, phase1 );
-            memcpy( z.tlbp, src+phase1, len-phase1 );
+            // No room yet, leave it at the front of the queue
+            mq_pushback( &z.pending, msg );
+            mq_pushback_check_and_clear( &z.pending );
+            break;
         }
+        z.nbr_pending--;
+    }
+}
+
+/*************************************************************************
+ * Idle handler, send received frames up stack
+ *************************************************************************/
+void ether_idle()
+{
+    byte *rwp;
+    byte batch;
+    u32  now;
+    u16  room;
+
+    // Nothing to do unless an interrupt has flagged an event. As a
+    //  safety net (eg the EMAC can overrun without completing a frame),
+    //  poll anyway once per heartbeat tick.
+    if( !z.rx_event && !z.tx_event )
+    {
+        now = tick_get();
+        if( now == z.poll_tick )
+            return;
+        z.poll_tick = now;
+        z.rx_event  = true;
+        z.tx_event  = true;
+    }
 
-        // Update twp, HW TRP will catch up when the frame is TXed
-        z.twp = np;
-        //DBG printf( "Updated z.twp = %08lx\n", (u32) z.twp );
+    // Under a burst the EMAC can fill the rx ring while the run loop is
+    //  visiting every other task, so drain a batch of frames per visit.
+    //  The RWP HW register is only read once per batch, any frames that
+    //  arrive meanwhile will be picked up on the next visit. The batch
+    //  is bounded so that other tasks still get a look in. Clear the
+    //  event before reading RWP so no frame can slip through unflagged.
+    if( z.rx_event )
+    {
+        z.rx_event = false;
+        rwp = read_rwp();
+
+        // Track rx ring pressure, rx room is at its lowest just before
+        //  we drain a batch
+        room = rx_room( rwp );
+        if( room < z.stats.rx_room_min )
+            z.stats.rx_room_min = room;
+        for( batch=0; batch<RX_BATCH && z.rrp!=rwp; batch++ )
+            rx_frame( rwp );
+        if( z.rrp != rwp )
+            z.rx_event = true;  // come back for the rest
+    }
 
-        // To queue one packet for transmission, set next packet to HOST_OWNS,
-        //  this packet to EMAC_OWNS
-        ((DESC *)np)->flags = HOST_OWNS;
-        desc->flags = EMAC_OWNS;
+    // A completed tx frame makes room in the tx ring, so send any frames
+    //  waiting for room
+    if( z.tx_event )
+    {
+        z.tx_event = false;
+        tx_drain();
     }
+}
 
-    // Free msg
-    msg_free(msg);
+/*************************************************************************
+ * EMAC rx interrupt, a frame has been received
+ *************************************************************************/
+void interrupt emacisr_rx( void )
+{
+    EMAC_ISTAT = RXDONE;    // write 1 to clear
+    z.rx_event = true;
 }
 
 /*************************************************************************
- * Idle handler, send received frames up stack
+ * EMAC tx interrupt, a frame has been transmitted
  *************************************************************************/
-void ether_idle()
+void interrupt emacisr_tx( void )
+{
+    EMAC_ISTAT = TXDONE;    // write 1 to clear
+    z.tx_event = true;
+}
+
+/*************************************************************************
+ * Read one frame from EMAC SRAM and send it up the stack
+ *************************************************************************/
+static void rx_frame( byte *rwp )
 {
     DESC *desc;
     MSG  *msg;
-    byte *rwp;
+    byte *frame;
     u16  len, phase1;
     bool okay, skip=false;
-    byte lo,hi,lo2,hi2;
-    u16  frame_type;
+    TASKID taskid=TASKID_NULL;
+    IPADDR src_ipaddr;
+
+    // Read frame from EMAC SRAM
+    desc  = (DESC *)z.rrp;
+    okay  = ( (desc->flags & RX_OK) ? true : false );
+    len   = desc->len - 4; // take off CRC
 
-    // Check blocks left for receive overrun
-    #if 0
-    static u16 idx;
-    idx++;
-    if( (idx&0x3ff) == 0 )
+    // Count each bad frame once, an overrun usually has error status too
+    if( desc->flags & RX_OVR || desc->np==NULL )
     {
-        u16 blkslft = EMAC_BLKSLFT_L  +  ( ((u16)EMAC_BLKSLFT_H) << 8 );
+        z.stats.rx_overruns++;
+
+        // If overrun, write off what we have, set HW RRP to
+        //  catch up with HW RWP
         EMAC_ISTAT = RXOVRRUN;
-        printf( "blkslft = %u\n", blkslft );
+        z.rrp = rwp;
+        EMAC_RRP_L = (byte)( (u32)rwp  );
+        EMAC_RRP_H = (byte)( ((u32)rwp) >> 8 );
+        skip = true;
+        okay = false;
     }
-    #endif
-
-    // Read RWP HW register
-    do
+    else if( !okay )
+        z.stats.rx_drop_error++;
+    else if( len<MINFRAMESIZE || len>MAXFRAMESIZE )
     {
-        lo  = EMAC_RWP_L;
-        hi  = EMAC_RWP_H;
-        lo2 = EMAC_RWP_L;
-        hi2 = EMAC_RWP_H;
+        z.stats.rx_drop_length++;
+        okay = false;
     }
-    while( lo!=lo2 || hi!=hi2 );
-    rwp = z.emac_sram_base  +  lo  +  ( ((u16)hi) << 8 );
 
-    // If rrp lags rwp, we have frames to read
-    if( z.rrp != rwp )
+    // We don't want a wrapped around frame, so in the special case of a
+    //  wrapped frame, copy the wrapped tail (only) from the start of the
+    //  RX region to the MIRROR region, which immediately follows the end
+    //  of the RX region. The frame is then contiguous in place. MIRROR
+    //  is big enough for the tail of a max sized frame, so no frame is
+    //  lost just because it wrapped.
+    frame = z.rrp + sizeof(DESC);
+    if( okay )
     {
+        phase1 = z.rhbp - frame;
+        if( len > phase1 )
+        {
+            //DBG printf( "RX wrap\n" );
+            memcpy( z.mirror, z.bp, len-phase1 );
+            z.stats.rx_wraps++;
+        }
 
-        // Read frame from EMAC SRAM
-        desc  = (DESC *)z.rrp;
-        okay  = ( (desc->flags & RX_OK) ? true : false );
-        len   = desc->len - 4; // take off CRC
-        if( len < MINFRAMESIZE )
-            okay = false;
-        if( len > MAXFRAMESIZE )
+        // Capture frame
+        #ifdef DEBUG_CAPTURE
+        capture_frame( frame, len );
+        #endif
+
+        // Find out who wants it (if anyone), while the ethernet
+        //  addresses are still intact
+        taskid = demux( frame, len );
+        if( taskid == TASKID_NULL )
+        {
+            z.stats.rx_drop_filter++;
             okay = false;
-        if( desc->flags & RX_OVR || desc->np==NULL )
+        }
+        else
         {
+            z.stats.rx_frames++;
+            z.stats.rx_bytes += len;
 
-            // If overrun, write off what we have, set HW RRP to
-            //  catch up with HW RWP
-            EMAC_ISTAT = RXOVRRUN;
-            z.rrp = rwp;
-            EMAC_RRP_L = (byte)( (u32)rwp  );
-            EMAC_RRP_H = (byte)( ((u32)rwp) >> 8 );
-            skip = true;
-            okay = false;
+            // Learn the sender's ethernet address from IP frames sent to
+            //  us from our subnet, so we won't need to ARP for it to reply
+            if( !(frame[0]&0x01) &&
+                READ2(frame+ETH_OFFSET-2) == FRAME_TYPE_IP )
+            {
+                src_ipaddr = READ4(frame+ETH_OFFSET+12);
+                if( ((src_ipaddr^config.my_ipaddr)&config.subnet_mask)==0 )
+                    arp_learn( src_ipaddr, frame+ETHADDR_LEN );
+            }
         }
+    }
+
+    // Now we do a trick, instead of allocating a MSG to hold the
+    //  frame, we make the frame into a MSG. This avoids a copy,
+    //  and so saves time AND space. We first create a 12 byte
+    //  MSG structure on top of the first 12 bytes of the ethernet
+    //  frame, which are ethernet dest and source address fields
+    //  respectively. Luckily we don't need either of them after
+    //  demux().
+    if( !skip )
+    {
+        assert( sizeof(MSG) == 12 );
+        len -= sizeof(MSG);
+        msg = (MSG *)frame;
+        msg->inuse  = MSG_INUSE_USER;   // so that our msg_free() routine
+                                        //  is used
+        msg->offset = 2;    // pretend the first two bytes of the
+                            //  message, which are the ethertype have
+                            //  been pushed on the front (see msg_pop2()
+                            //  below)
+        msg->base   = frame + sizeof(MSG);
+        msg->ptr    = msg->base;
+        msg->size   = len;
+        msg->len    = len;
+        //DBG printf( "RX z.rrp = %08lx\n", (u32) z.rrp );
+
+        // Note where we are so that user_msg_free() can release memory
+        //  back to EMAC
+        z.rrp = desc->np;
+
+        // Frames we don't want are freed straight away, this releases
+        //  the memory back to the EMAC in the right order
         if( !okay )
         {
-            // Update rrp to next pkt
-            if( !skip )
-                z.rrp = desc->np;
-            //DBG printf( "RX updated z.rrp = %08lx\n", (u32) z.rrp );
+            msg_free(msg);
+            return;
         }
-        else
-        {
 
-            // Now we do a trick, instead of allocating a MSG to hold the
-            //  frame, we make the frame into a MSG. This avoids a copy,
-            //  and so saves time AND space. We first create a 12 byte
-            //  MSG structure on top of the first 12 bytes of the ethernet
-            //  frame, which are ethernet dest and source address fields
-            //  respectively. Luckily we don't need either of them.
-            assert( sizeof(MSG) == 12 );
-            len -= sizeof(MSG);
-            msg = (MSG *)(z.rrp + sizeof(DESC));
-            msg->inuse  = MSG_INUSE_USER;   // so that our msg_free() routine
-                                            //  is used
-            msg->offset = 2;    // pretend the first two bytes of the
-                                //  message, which are the ethertype have
-                                //  been pushed on the front (see msg_pop2()
-                                //  below)
-            msg->base   = z.rrp + sizeof(DESC) + sizeof(MSG);
-            msg->ptr    = msg->base;
-            msg->size   = len;
-            msg->len    = len;
-            //DBG printf( "RX z.rrp = %08lx\n", (u32) z.rrp );
-
-            // We don't want a wrapped around message, so in the special
-            //  case of a wrapped frame, copy the frame data to the
-            //  reserved WRAP region at the front of the EMAC SRAM, the
-            //  MSG structure stays in exactly the same place (only the
-            //  ptrs to the data change).
-            phase1 = z.rhbp - msg->ptr;
-            if( len > phase1 )
+        // Debug receive frames
+        #ifdef DEBUG_RX_FRAME
+        show( msg, true );
+        #endif
+
+        // Take off frame type
+        msg_pop2( msg );
+
+        // For debugging, test retries by throwing away regular frames
+        #ifdef DEBUG_RX_DISCARD
+        if( taskid == TASKID_IP )
+        {
+            static byte discard=0x10;
+            discard = 0x1f&(discard+1);
+            if( discard == 0 )
             {
-                //DBG printf( "RX wrap\n" );
-                memcpy( z.wrap, msg->ptr, phase1 );
-                memcpy( z.wrap+phase1, z.bp, len-phase1 );
-                msg->base   = z.wrap;
-                msg->ptr    = msg->base;
+                msg_free(msg);
+                printf( "*DISCARDED RX*\n" );
+                return;
             }
+        }
+        #endif
 
-            // Note where we are so that user_msg_free() can release memory
-            //  back to EMAC
-            z.rrp = desc->np;
+        // Send the frame up to the task that wants it
+        bmz_up( taskid, msg );
+    }
+}
 
-            // Debug receive frames
-            #ifdef DEBUG_RX_FRAME
-            show( msg, true );
-            #endif
+/*************************************************************************
+ * Decide which task (if any) wants a received frame
+ *************************************************************************/
+// Frame format;
+//      [dst ethaddr,6]
+//      [src ethaddr,6]
+//      [frame type,2]
+//      [payload]
+static TASKID demux( const byte *frame, u16 len )
+{
+    const byte *payload = frame + ETH_OFFSET;
+    const FILTER *f;
+    u16  frame_type, fragmentation, port=0;
+    byte i, hlen, protocol=0;
+    bool broadcast, have_port=false, later_fragment=false;
+    IPADDR dst_ipaddr, subnet_broadcast;
+
+    // The EMAC address filter only passes frames addressed to us and
+    //  broadcast frames. Check the group bit to see which.
+    broadcast  = ( (frame[0]&0x01) ? true : false );
+    frame_type = READ2(frame+ETH_OFFSET-2);
+
+    // ARP only cares about requests and replies for our IP address
+    if( frame_type == FRAME_TYPE_ARP )
+    {
+        if( len < ETH_OFFSET+28 )
+            return( TASKID_NULL );
+        if( READ4(payload+24) != config.my_ipaddr )  // target ipaddr
+            return( TASKID_NULL );
+    }
 
-            // Send the frame to known protocols
-            frame_type = msg_pop2( msg );
-            if( frame_type == FRAME_TYPE_IP )
-            {
+    // Sanity check IP header, then pick out the fields we filter on
+    else if( frame_type == FRAME_TYPE_IP )
+    {
+        if( len < ETH_OFFSET+STD_IP_HEADER_LEN )
+            return( TASKID_NULL );
+        if( (payload[0]&0xf0) != 0x40 )     // IP version 4 ?
+            return( TASKID_NULL );
+        hlen = (payload[0]&0x0f) << 2;
+        if( hlen<STD_IP_HEADER_LEN || ETH_OFFSET+hlen>len )
+            return( TASKID_NULL );
+        protocol   = payload[9];
+        dst_ipaddr = READ4(payload+16);
+        if( dst_ipaddr != config.my_ipaddr )
+        {
+            subnet_broadcast = config.my_ipaddr |
+                                    (0xffffffff ^ config.subnet_mask);
+            if( dst_ipaddr!=0xffffffff &&
+                (config.subnet_mask==0 || dst_ipaddr!=subnet_broadcast)
+              )
+                return( TASKID_NULL );
+            broadcast = true;
+        }
 
-                // For debugging, test retries by throwing away regular frames
-                #ifdef DEBUG_RX_DISCARD
-                static byte discard=0x10;
-                discard = 0x1f&(discard+1);
-                if( discard == 0 )
-                {
-                    msg_free(msg);
-                    printf( "*DISCARDED RX*\n" );
-                }
-                else
-                #endif
-                    bmz_up( TASKID_IP, msg );
-            }
-            else if( frame_type == FRAME_TYPE_ARP )
-                bmz_up( TASKID_ARP, msg );
+        // Only the first fragment of a TCP or UDP datagram has the ports,
+        //  later fragments match any filter for the protocol (the port
+        //  is checked after IP reassembles the datagram)
+        fragmentation = READ2(payload+6);
+        later_fragment = ( (fragmentation&0x1fff) ? true : false );
+        if( !later_fragment &&
+            (protocol==PROTOCOL_TCP || protocol==PROTOCOL_UDP) &&
+            ETH_OFFSET+hlen+4 <= len
+          )
+        {
+            port = READ2(payload+hlen+2);   // dst port
+            have_port = true;
+        }
+    }
 
-            // Discard if not known protocol
-            else
-                msg_free(msg);
+    // First matching filter wins
+    for( i=0, f=z.filter; i<FILTER_NBR; i++, f++ )
+    {
+        if( f->taskid     != TASKID_NULL    &&
+            f->frame_type == frame_type     &&
+            (f->protocol==ETHER_FILTER_ANY || f->protocol==protocol) &&
+            (!broadcast || (f->flags&ETHER_FILTER_BROADCAST))       &&
+            (   (f->port_lo==0 && f->port_hi==0xffff) ||
+                (have_port && f->port_lo<=port && port<=f->port_hi) ||
+                later_fragment
+            )
+          )
+            return( f->taskid );
+    }
+    return( TASKID_NULL );
+}
+
+/*************************************************************************
+ * Add a receive filter entry
+ *************************************************************************/
+bool ether_filter_add( u16 frame_type, byte protocol, u16 port_lo,
+                               u16 port_hi, byte flags, TASKID taskid )
+{
+    byte i;
+    FILTER *f;
+    for( i=0, f=z.filter; i<FILTER_NBR; i++, f++ )
+    {
+        if( f->taskid == TASKID_NULL )
+        {
+            f->frame_type = frame_type;
+            f->protocol   = protocol;
+            f->port_lo    = port_lo;
+            f->port_hi    = port_hi;
+            f->flags      = flags;
+            f->taskid     = taskid;
+            return( true );
         }
     }
+    return( false );    // table full
+}
+
+/*************************************************************************
+ * Remove a receive filter entry
+ *************************************************************************/
+void ether_filter_remove( u16 frame_type, byte protocol, u16 port_lo,
+                                                           u16 port_hi )
+{
+    byte i;
+    FILTER *f;
+    for( i=0, f=z.filter; i<FILTER_NBR; i++, f++ )
+    {
+        if( f->taskid     != TASKID_NULL    &&
+            f->frame_type == frame_type     &&
+            f->protocol   == protocol       &&
+            f->port_lo    == port_lo        &&
+            f->port_hi    == port_hi
+          )
+            f->taskid = TASKID_NULL;
+    }
 }
 
 /*************************************************************************
@@ -565,12 +914,48 @@ void user_msg_free( MSG *msg )
  * Room in rx ring buffer
  *************************************************************************/
 u16 ether_rx_room()
+{
+    return( rx_room( read_rwp() ) );
+}
+
+
+/*************************************************************************
+ * Checksum offload capabilities
+ *************************************************************************/
+// The EMAC doesn't calculate or test checksums, the upper layers do it all
+byte ether_get_caps()
+{
+    return( 0 );
+}
+
+
+/*************************************************************************
+ * Room in rx ring buffer, given the RWP HW register
+ *************************************************************************/
+static u16 rx_room( byte *rwp )
 {
     u16  room, size=z.rhbp-z.bp;
-    byte *rwp, *rrp;
+    byte *rrp;
+
+    // Compare to RRP HW register
+    rrp = z.emac_sram_base  +  EMAC_RRP_L  +  ( ((u16)EMAC_RRP_H) << 8 );
+    if( rwp >= rrp )
+        room = size - (rwp-rrp);
+    else
+        room = rrp-rwp;
+    return( room );
+}
+
+
+/*************************************************************************
+ * Read RWP HW register
+ *************************************************************************/
+static byte *read_rwp()
+{
     byte lo,hi,lo2,hi2;
 
-    // Read RWP HW register
+    // The EMAC can update RWP between reads of the low and high bytes,
+    //  so read until we get the same value twice
     do
     {
         lo  = EMAC_RWP_L;
@@ -579,15 +964,79 @@ u16 ether_rx_room()
         hi2 = EMAC_RWP_H;
     }
     while( lo!=lo2 || hi!=hi2 );
-    rwp = z.emac_sram_base  +  lo  +  ( ((u16)hi) << 8 );
+    return( z.emac_sram_base  +  lo  +  ( ((u16)hi) << 8 ) );
+}
 
-    // Compare to RRP HW register
-    rrp = z.emac_sram_base  +  EMAC_RRP_L  +  ( ((u16)EMAC_RRP_H) << 8 );
-    if( rwp >= rrp )
-        room = size - (rwp-rrp);
-    else
-        room = rrp-rwp;
-    return( room );
+
+/*************************************************************************
+ * Read TRP HW register
+ *************************************************************************/
+static byte *read_trp()
+{
+    byte lo,hi,lo2,hi2;
+
+    // As for RWP, read until we get the same value twice
+    do
+    {
+        lo  = EMAC_TRP_L;
+        hi  = EMAC_TRP_H;
+        lo2 = EMAC_TRP_L;
+        hi2 = EMAC_TRP_H;
+    }
+    while( lo!=lo2 || hi!=hi2 );
+    return( z.emac_sram_base  +  lo  +  ( ((u16)hi) << 8 ) );
+}
+
+
+/*************************************************************************
+ * Get statistics
+ *************************************************************************/
+void ether_get_stats( ETHER_STATS *stats )
+{
+    *stats = z.stats;
+}
+
+
+/*************************************************************************
+ * Clear statistics
+ *************************************************************************/
+void ether_clear_stats()
+{
+    memset( &z.stats, 0, sizeof(z.stats) );
+    z.stats.rx_room_min = 0xffff;
+}
+
+
+/*************************************************************************
+ * Show statistics on console
+ *************************************************************************/
+void ether_show_stats()
+{
+    show_stat( "rx frames ",            z.stats.rx_frames );
+    show_stat( "rx bytes ",             z.stats.rx_bytes );
+    show_stat( "tx frames ",            z.stats.tx_frames );
+    show_stat( "tx bytes ",             z.stats.tx_bytes );
+    show_stat( "rx overruns ",          z.stats.rx_overruns );
+    show_stat( "rx wraps ",             z.stats.rx_wraps );
+    show_stat( "rx drop, error ",       z.stats.rx_drop_error );
+    show_stat( "rx drop, length ",      z.stats.rx_drop_length );
+    show_stat( "rx drop, filter ",      z.stats.rx_drop_filter );
+    show_stat( "tx stalls ",            z.stats.tx_stalls );
+    show_stat( "tx drop, link down ",   z.stats.tx_drop_link_down );
+    show_stat( "tx drop, queue full ",  z.stats.tx_drop_queue_full );
+    show_stat( "tx drop, length ",      z.stats.tx_drop_length );
+    show_stat( "rx room min ",          z.stats.rx_room_min );
+}
+
+
+/*************************************************************************
+ * Show one statistic on console
+ *************************************************************************/
+static void show_stat( const char *txt, u32 n )
+{
+    putstr( txt );
+    putu32( n );
+    putstr( "\n" );
 }
 
 
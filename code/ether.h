@@ -8,4 +8,46 @@ void ether_idle();
 void ether_timeout( byte timer_id );
 void ether_set_addr( const byte *ethaddr );
 u16  ether_rx_room();
+
+// Checksum offload capabilities. Upper layers skip checksum work that
+//  the link does for them.
+#define ETHER_CAPS_TX_CSUM  0x01    // link inserts IP, ICMP, TCP and UDP
+                                    //  checksums in frames sent
+#define ETHER_CAPS_RX_CSUM  0x02    // link only delivers frames with valid
+                                    //  checksums
+byte ether_get_caps();
+
+// Driver statistics
+typedef struct
+{
+    u32 rx_frames;          // received frames sent up the stack
+    u32 rx_bytes;
+    u32 tx_frames;          // frames handed to the EMAC
+    u32 tx_bytes;
+    u32 rx_overruns;        // rx ring overruns, frames lost
+    u32 rx_wraps;           // rx frames wrapped around end of ring
+    u32 rx_drop_error;      // rx frames with EMAC error status (other
+                            //  than overruns, counted above)
+    u32 rx_drop_length;     // rx frames too short or too long
+    u32 rx_drop_filter;     // rx frames not wanted by any task
+    u32 tx_stalls;          // tx frames queued waiting for EMAC
+    u32 tx_drop_link_down;  // tx frames discarded, link down
+    u32 tx_drop_queue_full; // tx frames discarded, tx queue full
+    u32 tx_drop_length;     // tx frames discarded, longer than
+                            //  MAXFRAMESIZE
+    u16 rx_room_min;        // low water mark of ether_rx_room()
+} ETHER_STATS;
+void ether_get_stats( ETHER_STATS *stats );
+void ether_clear_stats();
+void ether_show_stats();
+
+// Receive filter table. Received frames that match no entry are dropped
+//  before any protocol task sees them. Port ranges apply to TCP and UDP
+//  destination ports, use 0-0xffff for any port.
+#define ETHER_FILTER_ANY        0       // any IP protocol
+#define ETHER_FILTER_BROADCAST  0x01    // accept broadcast frames too
+bool ether_filter_add( u16 frame_type, byte protocol, u16 port_lo,
+                               u16 port_hi, byte flags, TASKID taskid );
+void ether_filter_remove( u16 frame_type, byte protocol, u16 port_lo,
+                                                           u16 port_hi );
 #endif // ETHER_H
@@ -10,12 +10,14 @@
 #include "bmz.h"
 #include "tcpip.h"
 #include "checksum.h"
+#include "ether.h"
 #include "icmp.h"
 
 /*************************************************************************
  * Message up
  *************************************************************************/
 // Message format in (up from IP);
+//      [loopback,1]
 //      [src_ipaddr,4]
 //      [payload]
 // Message format out (down to IP);
@@ -25,15 +27,20 @@
 void icmp_up( MSG *msg )
 {
     bool   err=false;
-    u16    *poke;
-    u16    checksum, len;
+    u16    *poke, *peek;
+    u16    checksum, len, old;
     MSG    *reply=NULL;
 
     // Take off parameter
+    bool   loopback   = msg_pop1(msg);
     IPADDR rem_ipaddr = msg_pop4(msg);
 
-    // Test checksum
-    err = checksum_test( msg_ptr(msg), msg_len(msg), 2 );
+    // Too short for type, code and checksum ? Otherwise test checksum,
+    //  unless the link already has or it was looped back
+    if( msg_len(msg) < 4 )
+        err = true;
+    else if( !loopback && !(ether_get_caps() & ETHER_CAPS_RX_CSUM) )
+        err = checksum_test( msg_ptr(msg), msg_len(msg), 2 );
 
     // Test for echo request
     if( !err )
@@ -54,12 +61,25 @@ void icmp_up( MSG *msg )
             len = msg_len(msg);     // shorten to size of request
         memcpy( msg_ptr(reply), msg_ptr(msg), len );
         msg_len(reply)  = len;      // assumes msg_len() is macro
+        peek  = (u16 *)msg_ptr(reply);
+        old   = *peek;              // type and code, native order
         *msg_ptr(reply) = 0;        // type==0 is reply
 
-        // Calculate and insert checksum
+        // Only the type has changed, so adjust the request's checksum
+        //  rather than calculating it again, unless we shortened it (or
+        //  checksum_test() let it through without a checksum). If the
+        //  link inserts checksums, or the reply goes back round the loop,
+        //  leave it zero.
         poke  = (u16 *)( msg_ptr(reply) + 2 );
-        *poke = 0;
-        checksum = checksum_calculate( msg_ptr(reply), msg_len(reply) );
+        if( loopback || (ether_get_caps() & ETHER_CAPS_TX_CSUM) )
+            checksum = 0;
+        else if( len==msg_len(msg) && *poke!=0 )
+            checksum = checksum_adjust( *poke, old, *peek );
+        else
+        {
+            *poke = 0;
+            checksum = checksum_calculate( msg_ptr(reply), msg_len(reply) );
+        }
         *poke = checksum;
 
         // Add output parameters
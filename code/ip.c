@@ -5,11 +5,13 @@
  *  Project: eZ2944
  *************************************************************************/
 #include <stdio.h>
+#include <string.h>
 #include "project.h"
 #include "bmz.h"
 #include "tick.h"
 #include "tcpip.h"
 #include "checksum.h"
+#include "ether.h"
 #include "ip.h"
 
 // Misc
@@ -17,24 +19,137 @@
                                 //  (version, header length, type of service)
 #define STD_IP_HEADER_LEN 20    // Standard header length, with no options
 #define TTL  40                 // value of TTL field in sent datagram
+#define LOOPBACK_NET(ipaddr) ( ((ipaddr)&0xff000000)==0x7f000000 )
+#define LOOPBACK(ipaddr) ( (ipaddr)==config.my_ipaddr || LOOPBACK_NET(ipaddr) )
+
+// Routing uses a small table, the route with the longest matching prefix
+//  wins. The table starts with a route to our own subnet and a default
+//  route, from config, and others can be added at runtime. Since
+//  consecutive datagrams usually go to the same place, the last decision
+//  is remembered and reused without searching the table.
+// Fragmented datagrams are reassembled in one of IP_REASM_NBR slots,
+//  each with a MSG from our own pool big enough for IP_REASM_LEN bytes
+//  of payload, so memory use is fixed. A bitmap records which 8 byte
+//  blocks have arrived. A datagram that doesn't complete in time, or
+//  that turns out to be too big, is discarded. When all slots are busy
+//  a new datagram takes over the oldest slot, once that has waited
+//  REASM_EVICT seconds, so a stray fragment can't hold a slot for the
+//  whole REASM_TIMEOUT. Note that IP_REASM_LEN only covers datagrams
+//  fragmented on paths with a small MTU, anything fragmented because
+//  it didn't fit an ethernet frame (e.g. a large ICMP echo) is bigger
+//  than that and is still discarded.
+// Datagrams for our own address (or 127.x.x.x) are looped back. They are
+//  queued rather than passed straight up, since the sender is usually
+//  partway through handling something and mustn't be reentered, and
+//  ip_idle() sends them up later. They never go near ARP or the EMAC,
+//  and since they can't be corrupted in memory no checksums are
+//  calculated or tested for them. The layers above ask ip_loopback()
+//  before calculating one, and are told a datagram was looped back so
+//  they don't test it. A datagram to 127.x.x.x is sent from the same
+//  address, so replies go back to where they came from.
+// The header checksum of datagrams we send isn't calculated from the
+//  header in memory. Most fields are the same every time, so their sum
+//  is kept and only the length, identification, protocol and dst are
+//  added to it.
+
+// Reassembly
+#define REASM_TIMEOUT   15      // seconds to wait for all fragments
+#define REASM_EVICT     1       // seconds before a new datagram can take
+                                //  over a busy slot
+#define REASM_OFFSET    (ETH_OFFSET+STD_IP_HEADER_LEN+4)
+                                // room to push headers in front of a
+                                //  reassembled datagram
+#define REASM_BLOCKS    ((IP_REASM_LEN+7)/8)
+
+// A datagram being reassembled
+typedef struct
+{
+    MSG     *msg;           // NULL if slot is free
+    IPADDR  src_ipaddr;     // src, identification and protocol identify
+    u16     identification; //  the datagram
+    byte    protocol;
+    u16     total_len;      // length of payload, 0 until last fragment
+    u32     start_tick;     // when the first fragment arrived
+    byte    received[(REASM_BLOCKS+7)/8];   // 8 byte blocks received
+    TIMER   timer;
+} REASM;
+
+// A route to a network
+typedef struct
+{
+    IPADDR  dst_ipaddr;     // network
+    IPADDR  mask;
+    IPADDR  gateway;        // 0 if directly connected
+} ROUTE;
 
 // Module data
 typedef struct
 {
     u16     identification; // incrementing datagram identification
     bool    id_reset;       // reset identification once
+    u32     hdr_sum;        // sum of header fields that never change
+    ROUTE   route[IP_ROUTE_NBR];
+    byte    nbr_routes;
+    bool    last_valid;     // last routing decision
+    IPADDR  last_dst_ipaddr;
+    IPADDR  last_next_hop;
+    MQ      loopback;       // datagrams to ourselves, waiting to go up
+    POOL    pool;           // reassembly MSGs
+    REASM   reasm[IP_REASM_NBR];
 } IP;
 static IP z;
 
 // Local prototypes
 static IPADDR route( IPADDR dst_ipaddr );
+static void input( MSG *msg, bool loopback );
+static MSG *reassemble( MSG *msg, IPADDR src_ipaddr, u16 identification,
+                                      byte protocol, u16 fragmentation );
+static void reasm_free( REASM *r );
 
 /*************************************************************************
  * Init
  *************************************************************************/
 void *ip_init( byte **addr_mem, u16 *addr_len )
 {
+    u32 mask = 0xffffffff;
+    IPADDR my_ipaddr = config.my_ipaddr;
+    byte i;
     z.id_reset = true;
+
+    // Sum of header fields that are the same in every datagram we send
+    z.hdr_sum = (u32)VER_HLEN_TOS + (u16)(my_ipaddr>>16) + (u16)my_ipaddr;
+
+    // Loopback queue
+    mq_init( &z.loopback, addr_mem, addr_len, DEFAULT_MQ_DEPTH );
+
+    // Reassembly slots
+    pool_init( &z.pool, addr_mem, addr_len, IP_REASM_NBR,
+                                REASM_OFFSET+IP_REASM_LEN, REASM_OFFSET );
+    for( i=0; i<IP_REASM_NBR; i++ )
+    {
+        z.reasm[i].msg = NULL;
+        timer_reset( &z.reasm[i].timer, i );
+    }
+
+    // Our subnet is directly connected, if there's no subnet mask use
+    //  the class of our address
+    if( config.subnet_mask )
+        mask = config.subnet_mask;
+    else
+    {
+        if( (my_ipaddr&0x80000000) == 0 )
+            mask = 0xff000000;  // class A
+        else if( (my_ipaddr&0xc0000000) == 0x80000000 )
+            mask = 0xffff0000;  // class B
+        else if( (my_ipaddr&0xe0000000) == 0xc0000000 )
+            mask = 0xffffff00;  // class C
+    }
+    z.nbr_routes = 0;
+    ip_route_add( my_ipaddr&mask, mask, 0 );
+
+    // Everything else goes to the default router
+    if( config.default_route )
+        ip_route_add( 0, 0, config.default_route );
     return( &z );
 }
 
@@ -51,36 +166,56 @@ void *ip_init( byte **addr_mem, u16 *addr_len )
 //      [payload]
 void ip_down( MSG *msg )
 {
-    u16 len, checksum, *poke;
-    IPADDR next_hop;
+    u16 len, checksum, identification;
+    IPADDR next_hop, src_ipaddr;
+    bool loopback;
 
     // Take off parameters
     byte   protocol   = msg_pop1(msg);
     IPADDR dst_ipaddr = msg_pop4(msg);
 
+    // Looped back datagrams to 127.x.x.x come from the same address
+    loopback   = LOOPBACK(dst_ipaddr);
+    src_ipaddr = ( LOOPBACK_NET(dst_ipaddr) ? dst_ipaddr : config.my_ipaddr );
+
     // Calculate total length
     len = msg_len(msg) + STD_IP_HEADER_LEN;
 
+    // Datagram identification
+    if( z.id_reset )                    // one time only randomisation
+    {
+        z.id_reset = false;
+        z.identification = (u16)tick_get_hi_res();
+    }
+    identification = z.identification++;
+
+    // Header checksum, only add the fields that change to the sum of the
+    //  fields that don't (or leave it to the link, or skip it if looped
+    //  back)
+    checksum = 0;
+    if( !loopback && !(ether_get_caps() & ETHER_CAPS_TX_CSUM) )
+        checksum = checksum_fold( z.hdr_sum + len + identification +
+                                  ( (((u16)TTL)<<8) | protocol ) +
+                                  (u16)(dst_ipaddr>>16) + (u16)dst_ipaddr );
+
     // Add ip header
     msg_push4( msg, dst_ipaddr );       // dst
-    msg_push4( msg, config.my_ipaddr ); // src
-    msg_push2( msg, 0 );                // chksum
+    msg_push4( msg, src_ipaddr );       // src
+    msg_push2( msg, checksum );         // chksum
     msg_push1( msg, protocol );         // protocol
     msg_push1( msg, TTL );              // ttl
     msg_push2( msg, 0 );                // fragmentation=0 (no fragmentation)
-    if( z.id_reset )                    // one time only randomisation
+    msg_push2( msg, identification );   // datagram identification
+    msg_push2( msg, len );              // total length
+    msg_push2( msg, VER_HLEN_TOS );     // version, hlen, type of service
+
+    // Loop back datagrams to ourselves
+    if( loopback )
     {
-        z.id_reset = false;
-        z.identification = (u16)tick_get_hi_res();
+        if( !mq_write( &z.loopback, msg ) )
+            msg_free( msg );    // queue full, discard
+        return;
     }
-    msg_push2( msg, z.identification++ );   // datagram identification
-    msg_push2( msg, len );                  // total length
-    msg_push2( msg, VER_HLEN_TOS );         // version, hlen, type of service
-
-    // Insert IP header checksum
-    checksum = checksum_calculate( msg_ptr(msg), STD_IP_HEADER_LEN );
-    poke  = (u16 *)( msg_ptr(msg) + 10 );
-    *poke = checksum;
 
     // Route
     next_hop = route( dst_ipaddr );
@@ -100,14 +235,39 @@ void ip_down( MSG *msg )
 //      [ip hdr]
 //      [payload]
 // Message format out (up to TCP or other protocol);
+//      [loopback,1]    true if looped back, no checksums to test
 //      [src ipaddr,4]
+//      [dst ipaddr,4]  (UDP only, it may be a broadcast address)
 //      [payload]
 void ip_up( MSG *msg )
+{
+    input( msg, false );
+}
+
+
+/*************************************************************************
+ * Idle
+ *************************************************************************/
+void ip_idle()
+{
+    MSG *msg;
+
+    // Send a looped back datagram up
+    msg = mq_read( &z.loopback );
+    if( msg )
+        input( msg, true );
+}
+
+
+/*************************************************************************
+ * Datagram in, from ETHER or looped back
+ *************************************************************************/
+static void input( MSG *msg, bool loopback )
 {
     u16 len = msg_len(msg);
-    u16 total_len, fragmentation;
+    u16 total_len, identification, fragmentation;
     byte ver_hlen, hlen, protocol;
-    IPADDR src_ipaddr;
+    IPADDR src_ipaddr, dst_ipaddr;
     bool err=false;
 
     // Test basic validity and compatibility
@@ -129,8 +289,8 @@ void ip_up( MSG *msg )
         }
     }
 
-    // Test checksum
-    if( !err )
+    // Test checksum, unless the link already has
+    if( !err && !loopback && !(ether_get_caps()&ETHER_CAPS_RX_CSUM) )
         err = checksum_test( msg_ptr(msg), hlen, 10 );
 
     // Take off the standard ip header, verify fields
@@ -138,13 +298,13 @@ void ip_up( MSG *msg )
     {
                         msg_pop2( msg );  // ver_hlen_tos
         total_len     = msg_pop2( msg );  // total length
-                        msg_pop2( msg );  // identification
+        identification= msg_pop2( msg );  // identification
         fragmentation = msg_pop2( msg );  // fragmentation
                         msg_pop1( msg );  // ttl
         protocol      = msg_pop1( msg );  // protocol
                         msg_pop2( msg );  // chksum
         src_ipaddr    = msg_pop4( msg );  // src
-                        msg_pop4( msg );  // dst
+        dst_ipaddr    = msg_pop4( msg );  // dst
 
         // Field total_len should be length of ip hdr + payload, which
         //  should match the length of our msg variable when it holds
@@ -161,10 +321,6 @@ void ip_up( MSG *msg )
         //  contents of the buffer to match field total_len
         else if( total_len < len )
             msg_len(msg) -= (len-total_len);    //assumes msg_len() is macro
-
-        // We cannot deal with fragmentation
-        if( (fragmentation&0x3fff) )    // allow don't fragment bit
-            err = true;
     }
 
     // Take off the rest of the ip header
@@ -172,8 +328,21 @@ void ip_up( MSG *msg )
     {
         msg_pop( msg, (byte)(hlen-STD_IP_HEADER_LEN) );   //zero if no options
 
-        // Add parameters
+        // A fragment goes for reassembly, carry on if that completes the
+        //  datagram
+        if( (fragmentation&0x3fff) )    // allow don't fragment bit
+        {
+            msg = reassemble( msg, src_ipaddr, identification, protocol,
+                                                         fragmentation );
+            if( !msg )
+                return;
+        }
+
+        // Add parameters, UDP needs the dst for its pseudo header
+        if( protocol == PROTOCOL_UDP )
+            msg_push4( msg, dst_ipaddr );
         msg_push4( msg, src_ipaddr );
+        msg_push1( msg, loopback );
 
         // Dispatch
         switch( protocol )
@@ -188,6 +357,11 @@ void ip_up( MSG *msg )
                 bmz_up( TASKID_ICMP, msg );
                 break;
             }
+            case PROTOCOL_UDP:
+            {
+                bmz_up( TASKID_UDP, msg );
+                break;
+            }
             default:
             {
                 err = true;
@@ -202,28 +376,235 @@ void ip_up( MSG *msg )
 }
 
 
+/*************************************************************************
+ * Test whether datagrams to an address are looped back
+ *************************************************************************/
+bool ip_loopback( IPADDR ipaddr )
+{
+    return( LOOPBACK(ipaddr) );
+}
+
+
+/*************************************************************************
+ * Timeout
+ *************************************************************************/
+void ip_timeout( byte timer_id )
+{
+    // Give up on an incomplete datagram
+    reasm_free( &z.reasm[timer_id] );
+}
+
+
+/*************************************************************************
+ * Reassemble a fragment, returns the complete datagram's payload once
+ *  all fragments have arrived, otherwise NULL. The fragment is consumed.
+ *************************************************************************/
+static MSG *reassemble( MSG *msg, IPADDR src_ipaddr, u16 identification,
+                                       byte protocol, u16 fragmentation )
+{
+    REASM *r, *found=NULL, *unused=NULL, *oldest=NULL;
+    MSG  *complete=NULL;
+    u16  offset = (fragmentation&0x1fff) << 3;
+    u16  len    = msg_len(msg);
+    bool more   = ( (fragmentation&0x2000) ? true : false );
+    u16  block, end;
+    byte i;
+
+    // Find the datagram's slot, or a free one to start it in
+    for( i=0, r=z.reasm; i<IP_REASM_NBR; i++, r++ )
+    {
+        if( !r->msg )
+        {
+            if( !unused )
+                unused = r;
+        }
+        else if( r->src_ipaddr     == src_ipaddr     &&
+                 r->identification == identification &&
+                 r->protocol       == protocol
+               )
+        {
+            found = r;
+            break;
+        }
+        else if( !oldest || r->start_tick-oldest->start_tick > 0x80000000 )
+            oldest = r;     // started earlier, allowing for wrap around
+    }
+
+    // If all slots are busy, give up on the oldest datagram if it has had
+    //  long enough
+    if( !found && !unused && oldest &&
+        tick_get()-oldest->start_tick >= REASM_EVICT*TICKS_PER_SECOND )
+    {
+        reasm_free( oldest );
+        unused = oldest;
+    }
+    if( !found && unused )
+    {
+        found = unused;
+        found->msg = pool_alloc( &z.pool );
+        if( found->msg )
+        {
+            found->src_ipaddr     = src_ipaddr;
+            found->identification = identification;
+            found->protocol       = protocol;
+            found->total_len      = 0;
+            found->start_tick     = tick_get();
+            memset( found->received, 0, sizeof(found->received) );
+            timer_start_seconds( &found->timer, REASM_TIMEOUT );
+        }
+        else
+            found = NULL;
+    }
+    r = found;
+
+    // Discard fragments we have no room for. All fragments except the
+    //  last must be a multiple of 8 bytes, a datagram too big for us is
+    //  discarded completely.
+    if( r )
+    {
+        end = offset + len;
+        if( end>IP_REASM_LEN || end<offset || (more && (len&7)) ||
+            (!more && r->total_len && r->total_len!=end)
+          )
+        {
+            reasm_free( r );
+            r = NULL;
+        }
+    }
+
+    // Copy in the fragment, and mark its blocks as received
+    if( r )
+    {
+        memcpy( msg_ptr(r->msg)+offset, msg_ptr(msg), len );
+        for( block=offset>>3; block<((end+7)>>3); block++ )
+            r->received[block>>3] |= (1<<(block&7));
+        if( !more )
+            r->total_len = end;
+
+        // Complete when we have the last fragment and every block before
+        //  it
+        if( r->total_len )
+        {
+            end = (r->total_len+7) >> 3;
+            for( block=0; block<end; block++ )
+            {
+                if( !(r->received[block>>3] & (1<<(block&7))) )
+                    break;
+            }
+            if( block == end )
+            {
+                complete = r->msg;
+                msg_len(complete) = r->total_len;
+                r->msg = NULL;
+                timer_stop( &r->timer );
+            }
+        }
+    }
+    msg_free( msg );
+    return( complete );
+}
+
+
+/*************************************************************************
+ * Discard a datagram being reassembled
+ *************************************************************************/
+static void reasm_free( REASM *r )
+{
+    if( r->msg )
+    {
+        msg_free( r->msg );
+        r->msg = NULL;
+    }
+    timer_stop( &r->timer );
+}
+
+
+/*************************************************************************
+ * Add a route
+ *************************************************************************/
+bool ip_route_add( IPADDR dst_ipaddr, IPADDR mask, IPADDR gateway )
+{
+    ROUTE *p;
+    byte  i;
+    bool  okay=true;
+
+    // Replace existing route to the same network, or add a new one
+    for( i=0, p=z.route; i<z.nbr_routes; i++, p++ )
+    {
+        if( p->dst_ipaddr==(dst_ipaddr&mask) && p->mask==mask )
+            break;
+    }
+    if( i == z.nbr_routes )
+    {
+        if( z.nbr_routes < IP_ROUTE_NBR )
+            z.nbr_routes++;
+        else
+            okay = false;
+    }
+    if( okay )
+    {
+        p->dst_ipaddr = dst_ipaddr&mask;
+        p->mask       = mask;
+        p->gateway    = gateway;
+        z.last_valid  = false;
+    }
+    return( okay );
+}
+
+/*************************************************************************
+ * Remove a route
+ *************************************************************************/
+bool ip_route_remove( IPADDR dst_ipaddr, IPADDR mask )
+{
+    byte i;
+    bool found=false;
+    for( i=0; i<z.nbr_routes; i++ )
+    {
+        if( z.route[i].dst_ipaddr==(dst_ipaddr&mask) &&
+            z.route[i].mask==mask )
+        {
+            found = true;
+            z.nbr_routes--;
+            z.route[i] = z.route[z.nbr_routes];
+            z.last_valid = false;
+            break;
+        }
+    }
+    return( found );
+}
+
 /*************************************************************************
  * Next hop router
  *************************************************************************/
 static IPADDR route( IPADDR dst_ipaddr )
 {
-    u32 mask = 0xffffffff;
-    IPADDR next_hop, my_ipaddr = config.my_ipaddr;
-    if( config.subnet_mask )
-        mask = config.subnet_mask;
-    else
+    ROUTE *p, *best=NULL;
+    byte  i;
+    IPADDR next_hop;
+
+    // Same as last time ?
+    if( z.last_valid && z.last_dst_ipaddr==dst_ipaddr )
+        return( z.last_next_hop );
+
+    // Find the longest matching prefix, for contiguous masks the longer
+    //  mask is the larger number
+    for( i=0, p=z.route; i<z.nbr_routes; i++, p++ )
     {
-        if( (my_ipaddr&0x80000000) == 0 )
-            mask = 0xff000000;  // class A
-        else if( (my_ipaddr&0xc0000000) == 0x80000000 )
-            mask = 0xffff0000;  // class B
-        else if( (my_ipaddr&0xe0000000) == 0xc0000000 )
-            mask = 0xffffff00;  // class C
+        if( (dst_ipaddr&p->mask) == p->dst_ipaddr &&
+            (!best || p->mask > best->mask)
+          )
+            best = p;
     }
-    if( (dst_ipaddr&mask) == (my_ipaddr&mask) )
-        next_hop = dst_ipaddr;
-    else
+    if( !best )
         next_hop = config.default_route;
+    else if( best->gateway )
+        next_hop = best->gateway;
+    else
+        next_hop = dst_ipaddr;
+
+    // Remember decision
+    z.last_valid      = true;
+    z.last_dst_ipaddr = dst_ipaddr;
+    z.last_next_hop   = next_hop;
     return( next_hop );
 }
-
@@ -5,4 +5,19 @@
 void *ip_init( byte **addr_mem, u16 *addr_len );
 void  ip_down( MSG *msg );
 void  ip_up( MSG *msg );
+void  ip_timeout( byte timer_id );
+void  ip_idle();
+
+// Add a route, to network dst_ipaddr/mask via gateway (gateway 0 means
+//  directly connected), replaces any route to the same network. Returns
+//  false if the routing table is full.
+bool  ip_route_add( IPADDR dst_ipaddr, IPADDR mask, IPADDR gateway );
+
+// Remove the route to network dst_ipaddr/mask, returns false if there
+//  is no such route
+bool  ip_route_remove( IPADDR dst_ipaddr, IPADDR mask );
+
+// Test whether datagrams to ipaddr are looped back (our own address or
+//  127.x.x.x), no checksums are needed for them
+bool  ip_loopback( IPADDR ipaddr );
 #endif  // IP_H
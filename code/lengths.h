@@ -8,6 +8,17 @@
 #define DEFAULT_POOL_NBR    4
 #define DEFAULT_POOL_LEN    500
 #define DEFAULT_POOL_OFFSET 54
+#define ARP_CACHE_NBR       8   // nbr of IP addresses ARP remembers
+#define ARP_PENDING_NBR     8   // nbr of frames ARP holds, waiting for
+                                //  addresses to be resolved
+#define IP_ROUTE_NBR        4   // nbr of routes in IP routing table
+#define IP_REASM_NBR        1   // nbr of datagrams IP can reassemble at
+                                //  once
+#define IP_REASM_LEN        576 // max payload of a reassembled datagram,
+                                //  enough for small MTU paths only
+#define UDP_SOCK_NBR        4   // nbr of UDP ports that can be bound
+#define TCPSOCK_HASH_NBR    8   // nbr of TCP connection hash chains,
+                                //  must be a power of 2
 #define ETH_OFFSET   (ETHADDR_LEN + ETHADDR_LEN + 2)
 #define ETH_MINFRAME 60 // eth header plus 46 bytes of data
 #endif  // LENGTHS_H
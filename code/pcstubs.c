@@ -7,13 +7,19 @@
  *  Project: eZ2944
  *************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <conio.h>
 #include "project.h"
 #include "bmz.h"
 #include "ether.h"
 #include "uart.h"
 #include "tick.h"
+#include "vlink.h"
+#include "tcppeer.h"
+#include "arp.h"
+#include "checksum.h"
 #undef PRINTF_SUPPRESS
 
 // Not needed on PC
@@ -27,25 +33,210 @@ void user_msg_free( MSG *msg )
     msg_free(msg);
 }
 
-// Not needed on PC
+// Hosted ether backend. Received frames are replayed from a pcap file
+//  and transmitted frames are written to another pcap file, so that real
+//  captures can be run against new builds. Configure with environment
+//  variables;
+//      BMZ_PCAP_IN     pcap file to replay
+//      BMZ_PCAP_OUT    pcap file for transmitted frames (if not set
+//                       transmitted frames are dumped to stdout)
+//      BMZ_PCAP_SPEED  replay speed, 1 = recorded timing (default),
+//                       N = N times faster, 0 = as fast as possible
+//  Frames in the input sent by us (our ethernet address) are skipped, as
+//  the stack will send its own. At the end of the input file a summary,
+//  including the average processing cost per frame, is printed and the
+//  program exits.
+// The replayed frames play the part of a peer at the far end of a
+//  virtual link (see vlink.h, configured with BMZ_VLINK_xxx environment
+//  variables), so the stack can be run under repeatable network
+//  conditions, bandwidth, latency, jitter, loss and reordering. By
+//  default the link is ideal. A replayed peer doesn't react to what the
+//  stack sends, so this is for checking the stack copes, not for
+//  measuring it.
+// To measure TCP, set BMZ_PEER_PORT instead of BMZ_PCAP_IN. A minimal
+//  live TCP peer (see tcppeer.h) then sits at the far end of the link,
+//  connects to that port on the stack and acks the data tserver sends
+//  until it has BMZ_PEER_BYTES (default 100000) bytes, or a minute has
+//  passed. The summary gives goodput, the RTT seen by the stack (one
+//  segment timed at a time, not retransmissions) and the stack's
+//  retransmissions.
+// The virtual link can't corrupt frames, so the stack can be told to
+//  skip its checksum work with BMZ_ETHER_CAPS (ETHER_CAPS_xxx flags,
+//  default 0). With ETHER_CAPS_TX_CSUM, ether_down() inserts the IP,
+//  TCP, UDP and ICMP checksums the way offload hardware would, before
+//  the frame goes to the output pcap and the link.
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_LINKTYPE_ETHER 1
+#define REPLAY_MAXFRAME     1514
+#define REPLAY_LINGER       (2*TICKS_PER_SECOND)  // after end of input
+#define REPLAY_FLOWS        4   // TCP flows tracked for retransmissions
+#define PEER_BYTES          100000  // default bytes for live peer
+#define PEER_LIMIT          (60*TICKS_PER_SECOND)   // live peer gives up
+typedef struct
+{
+    u16 src_port;
+    u16 dst_port;
+    u32 seq_end;                // highest sequence nbr sent, plus one
+    bool inuse;
+} FLOW;
+typedef struct
+{
+    FILE    *in;
+    FILE    *out;
+    bool    swapped;        // input byte order differs from ours
+    bool    nsec;           // input timestamps are in nanoseconds
+    u32     speed;
+    byte    caps;           // checksum offload, ETHER_CAPS_xxx
+    bool    have_frame;     // frame read and waiting to be sent
+    byte    frame[REPLAY_MAXFRAME];
+    u16     len;
+    bool    first;          // next frame is first frame
+    double  first_usec;     // timestamp of first frame
+    double  due_usec;       // when frame is due, relative to start
+    double  start_usec;     // when first frame was sent
+    bool    eof;            // input has run out
+    u32     eof_tick;       //  at this time
+    MSG     msg;            // for frames going up the stack
+    byte    buf[20+REPLAY_MAXFRAME];
+    byte    sink[VLINK_MAXFRAME];   // for frames arriving at the peer
+    FLOW    flow[REPLAY_FLOWS];
+
+    // Statistics
+    u32     frames_in;
+    u32     bytes_in;
+    u32     frames_skipped;
+    u32     frames_injected;
+    u32     frames_out;
+    u32     bytes_out;
+    u32     retransmits;
+
+    // Live peer, and RTT of the segment being timed
+    bool    peer;
+    u32     peer_tick;      // when the peer started
+    bool    rtt_pending;
+    u16     rtt_src_port;
+    u16     rtt_dst_port;
+    u32     rtt_seq_end;
+    double  rtt_start_usec;
+    u32     rtt_samples;
+    double  rtt_total;
+    double  rtt_min;
+    double  rtt_max;
+    clock_t cost;           // total processing time of injected frames
+} REPLAY;
+static REPLAY replay;
+
+// Local prototypes
+static u32  replay_read4( const byte *p );
+static bool replay_next();
+static void replay_done();
+static void replay_write4( u32 dat );
+static void replay_write2( u16 dat );
+static void replay_flow( const byte *frame, u16 len, double now_usec );
+static void replay_ack( const byte *frame, u16 len, double now_usec );
+static void replay_insert_checksums( byte *frame, u16 len );
+static void peer_done();
+static double host_usec();
+
+// Open pcap files
 void *ether_init( byte **addr_mem, u16 *addr_len )
 {
+    byte hdr[24];
+    u32  magic;
+    const char *s;
+    VLINK_CONFIG cfg;
+    vlink_config_from_env( &cfg );
+    vlink_init( &cfg );
+    s = getenv( "BMZ_PCAP_SPEED" );
+    replay.speed = ( s ? (u32)atol(s) : 1 );
+    s = getenv( "BMZ_ETHER_CAPS" );
+    replay.caps  = ( s ? (byte)atoi(s) : 0 );
+    replay.first = true;
+    s = getenv( "BMZ_PEER_PORT" );
+    if( s )
+    {
+        replay.peer = true;
+        replay.peer_tick = tick_get();
+        s = getenv( "BMZ_PEER_BYTES" );
+        tcppeer_init( (u16)atoi(getenv("BMZ_PEER_PORT")),
+                                    s ? (u32)atol(s) : PEER_BYTES );
+    }
+    s = getenv( "BMZ_PCAP_IN" );
+    if( s && !replay.peer )
+    {
+        replay.in = fopen( s, "rb" );
+        if( !replay.in )
+            printf( "Cannot open %s\n", s );
+        else if( 1 != fread(hdr,sizeof(hdr),1,replay.in) )
+            replay.in = NULL;
+        else
+        {
+            magic = replay_read4(hdr);
+            replay.swapped = ( magic!=PCAP_MAGIC && magic!=PCAP_MAGIC_NSEC );
+            magic = replay_read4(hdr);
+            replay.nsec = ( magic == PCAP_MAGIC_NSEC );
+            if( (magic!=PCAP_MAGIC && magic!=PCAP_MAGIC_NSEC) ||
+                replay_read4(hdr+20) != PCAP_LINKTYPE_ETHER
+              )
+            {
+                printf( "%s is not an ethernet pcap file\n", s );
+                replay.in = NULL;
+            }
+        }
+    }
+    s = getenv( "BMZ_PCAP_OUT" );
+    if( s )
+    {
+        replay.out = fopen( s, "wb" );
+        if( !replay.out )
+            printf( "Cannot open %s\n", s );
+        else
+        {
+            replay_write4( PCAP_MAGIC );
+            replay_write2( 2 );     // version 2.4
+            replay_write2( 4 );
+            replay_write4( 0 );     // timezone
+            replay_write4( 0 );     // timestamp accuracy
+            replay_write4( REPLAY_MAXFRAME );
+            replay_write4( PCAP_LINKTYPE_ETHER );
+        }
+    }
     return( NULL );
 }
 
-// Do a debug dump of transmitted frames
+// Write transmitted frames to pcap file, or do a debug dump, then send
+//  them into the virtual link
 void  ether_down( MSG *msg )
 {
     u16 i;
     byte *ptr = msg_ptr(msg);
-    printf( "ether_down(), msg=[" );
-    for( i=0; i<msg_len(msg); i++ )
+    double usec = host_usec();
+    if( replay.caps & ETHER_CAPS_TX_CSUM )
+        replay_insert_checksums( ptr, msg_len(msg) );
+    if( replay.out )
     {
-        if( i==6 || i==12 || i==14 || i==34 || i==54 )
-            printf("-");
-        printf( "%02x", 0xff & *ptr++ );
+        replay_write4( (u32)(usec/1000000.0) );
+        replay_write4( (u32)(usec - 1000000.0*(u32)(usec/1000000.0)) );
+        replay_write4( msg_len(msg) );
+        replay_write4( msg_len(msg) );
+        fwrite( ptr, msg_len(msg), 1, replay.out );
     }
-    printf( "]\n" );
+    else
+    {
+        printf( "ether_down(), msg=[" );
+        for( i=0; i<msg_len(msg); i++ )
+        {
+            if( i==6 || i==12 || i==14 || i==34 || i==54 )
+                printf("-");
+            printf( "%02x", 0xff & *ptr++ );
+        }
+        printf( "]\n" );
+    }
+    replay.frames_out++;
+    replay.bytes_out += msg_len(msg);
+    replay_flow( msg_ptr(msg), msg_len(msg), usec );
+    vlink_send( VLINK_STACK, msg_ptr(msg), msg_len(msg), usec );
     msg_free(msg);
 }
 
@@ -55,6 +246,41 @@ u16 ether_rx_room()
     return( 4000 );
 }
 
+// Checksum offload, as configured
+byte ether_get_caps()
+{
+    return( replay.caps );
+}
+
+// Not needed on PC, all frames go straight up
+bool ether_filter_add( u16 frame_type, byte protocol, u16 port_lo,
+                               u16 port_hi, byte flags, TASKID taskid )
+{
+    return( true );
+}
+
+// Not needed on PC
+void ether_filter_remove( u16 frame_type, byte protocol, u16 port_lo,
+                                                           u16 port_hi )
+{
+}
+
+// Not needed on PC, no driver statistics
+void ether_get_stats( ETHER_STATS *stats )
+{
+    memset( stats, 0, sizeof(*stats) );
+}
+
+// Not needed on PC
+void ether_clear_stats()
+{
+}
+
+// Not needed on PC
+void ether_show_stats()
+{
+}
+
 // Not needed on PC
 void uart_init( byte uart, u32 baudrate, byte bits, char parity, byte stop )
 {
@@ -84,249 +310,430 @@ void tick_init()
 }
 
 // Get system heartbeat, incrementing tick count, rate TICKS_PER_SECOND
-//  (fake it, use GetTickCount() if it becomes important
+//  (from the host clock, so timers run in real time)
 u32 tick_get()
 {
-    static u32 sys_ticks;
-    static u32 ticks;
-    if( ticks++ > 2000 )
-    {
-        ticks = 0;
-        sys_ticks++;
-    }
-    return( sys_ticks );
+    return( (u32)( ((double)clock()) * TICKS_PER_SECOND / CLOCKS_PER_SEC ) );
 }
 
 // Get high res tick, incrementing tick count, rate TICKS_PER_SECOND_HI_RES
 u32 tick_get_hi_res()
 {
-    return( tick_get()*10 );
+    return( (u32)( ((double)clock()) * TICKS_PER_SECOND_HI_RES
+                                                    / CLOCKS_PER_SEC ) );
 }
-
-/* Sample frames;
-   Format notes:
-    protocol 1=icmp,2=igmp,6=tcp,17=udp
-    frame_type 0x806=arp,0x800=ip, 0x8035=rarp
-
-    frag 0x2000 = more bit
-     0xe000 = bits mask
-    ttl=32 or 64
-    total_len=ip hdr+payload
-*/
-
-// Test frame for injection
-byte ARP_REPLY[] =
-{
-    0x00,0x01,
-    0x08,0x00,
-    6,
-    4,
-    0,2,
-    0xee,0xee,0x33,0x33,0x33,0x33,
-    192,168,2,9,
-    0xaa,0xaa,0x12,0x34,0x56,0x78,
-    192,168,2,42
-};
-
-/* Sample frames;
-   Format notes:
-    ip hdr =
-    0x4500          total_len
-    id              frag
-    ttl,protocol    chksum
-    src_ip
-    dst_ip
-
-    hlen=5 for 20 byte hdr
-    tcp header=
-    src_port        dst_port
-    seq
-    ack
-    hlen,reserved,urg,ack,psh,rst,syn,fin   window size
-    chksum              urgptr
-*/
-
-// Test frame for injection
-byte TCP_SYN[] =
-{
-    0x45,0x00,      0x00,0x28,
-    0x33,0x33,      0,0,
-    0x40,0x06,      0x00,0x00,
-    192,168,2,9,
-    192,168,2,42,
-
-
-    0x08,0x00,      0x00,0x17,
-    0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,
-    0x50,0x02,      0x08,0x00,
-    0x00,0x00,      0x00,0x00
-};
-
-
-// Test frame for injection
-byte TCP_ACK[] =
-{
-    0x45,0x00,      0x00,0x28,
-    0x33,0x34,      0,0,
-    0x40,0x06,      0x00,0x00,
-    192,168,2,9,
-    192,168,2,42,
-
-
-    0x08,0x00,      0x00,0x17,
-    0x00,0x00,0x00,0x01,
-    0x00,0x00,0x00,0x01,
-    0x50,0x10,      0x08,0x00,
-    0x00,0x00,      0x00,0x00
-};
-
-
-// Test frame for injection
-byte TCP_MORE[] =
-{
-    0x45,0x00,      0x00,0x2b,
-    0x33,0x35,      0,0,
-    0x40,0x06,      0x00,0x00,
-    192,168,2,9,
-    192,168,2,42,
-
-
-    0x08,0x00,      0x00,0x17,
-    0x00,0x00,0x00,0x01,    // and send 3
-    0x00,0x00,0x00,0x51,    // ack 0x50 bytes
-    0x50,0x10,      0x08,0x00,
-    0x00,0x00,      0x00,0x00,
-
-    'a', 'b', 'c'
-};
-
-
-// Test frame for injection
-byte tcp_syn_from_real_world[] =
-{
-    0x45, 0x00, 0x00, 0x30,
-    0x1b, 0x17, 0x40, 0x00,
-    0x80, 0x06, 0x59, 0xcc,
-    0xc0, 0xa8, 0x02, 0x6a,
-    0xc0, 0xa8, 0x02, 0x2a,
-
-    0x04, 0x70, 0x00, 0x17,
-    0xad, 0xc0, 0xcc, 0xc5,
-    0x00, 0x00, 0x00, 0x00,
-    0x70, 0x02, 0xfa, 0xf0,
-    0x83, 0x3c, 0x00, 0x00,
-    0x02, 0x04, 0x05, 0xb4,
-    0x01, 0x01, 0x04, 0x02
-};
-
-// Test frame for injection
-byte tcp_is_this_okay1[] =
-{
-    0x45, 0x00, 0x00, 0x28,
-    0xff, 0x7c, 0x00, 0x00,
-    0x28, 0x06, 0x0d, 0x6f,
-    0xc0, 0xa8, 0x02, 0x2a,
-    0xc0, 0xa8, 0x02, 0x6a,
-    0x0b, 0xf1, 0x04, 0x42,
-    0x00, 0x5a, 0xfe, 0x4c,
-    0x2b, 0x57, 0xb6, 0x2a,
-    0x50, 0x10, 0x03, 0xe8,
-    0x35, 0xac, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00
-};
-
-
-// Test frame for injection
-byte tcp_is_this_okay2[] =
-{
-    0x45, 0x00, 0x00, 0x28,
-    0x29, 0x72, 0x00, 0x00,
-    0x28, 0x06, 0xe3, 0x79,
-    0xc0, 0xa8, 0x02, 0x2a,
-    0xc0, 0xa8, 0x02, 0x6a,
-    0x13, 0x88, 0x04, 0x5a,
-    0x00, 0x00, 0x00, 0x00,
-    0xe2, 0x64, 0x9a, 0xc4,
-    0x50, 0x14, 0x00, 0x00,
-    0x94, 0xe0, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00
-};
-
-
-// Provide a simple testbed user interface
+
+// Replayed frames go into the virtual link when they are due, frames
+//  coming out of the link are injected into the stack
 void ether_idle()
 {
-    static byte buf[100];
-    static MSG m;
-    MSG *msg;
-    msg = &m;
-    msg->base = buf;
-    msg->size = sizeof(buf);
-    msg->offset = 20;
-    msg_clear(msg);
-    if( _kbhit() )
+    MSG *msg = &replay.msg;
+    clock_t before;
+    double  now_usec = host_usec();
+    u16     len, frame_type;
+    IPADDR  src_ipaddr;
+
+    // Peer end, send next frame into the link when it is due. When
+    //  running flat out wait for the previous frame to be processed.
+    if( replay.in && !replay.eof )
     {
-        int c = _getch();
-        if( c == '0' )
-        {
-            printf( "Sending ARP REPLY frame\n" );
-            memcpy( msg_ptr(msg), ARP_REPLY, sizeof(ARP_REPLY) );
-            msg_len(msg) = sizeof(ARP_REPLY);
-            bmz_up( TASKID_ARP, msg );
-        }
-        else if( c == '1' )
+        if( !replay.have_frame && !replay_next() )
         {
-            printf( "Sending TCP SYN frame\n" );
-            memcpy( msg_ptr(msg), TCP_SYN, sizeof(TCP_SYN) );
-            msg_len(msg) = sizeof(TCP_SYN);
-            bmz_up( TASKID_IP, msg );
+            replay.eof      = true;
+            replay.eof_tick = tick_get();
         }
-        else if( c == '2' )
+        else if( replay.first ||
+                 ( replay.speed &&
+                   now_usec-replay.start_usec >= replay.due_usec ) ||
+                 ( !replay.speed && !msg->inuse && !vlink_busy() )
+               )
         {
-            printf( "Sending TCP ACK frame\n" );
-            memcpy( msg_ptr(msg), TCP_ACK, sizeof(TCP_ACK) );
-            msg_len(msg) = sizeof(TCP_ACK);
-            bmz_up( TASKID_IP, msg );
+            if( replay.first )
+            {
+                replay.first      = false;
+                replay.start_usec = now_usec;
+            }
+            vlink_send( VLINK_PEER, replay.frame, replay.len, now_usec );
+            replay.have_frame = false;
         }
-        else if( c == '3' )
+    }
+
+    // Peer end, frames from the stack go to the live peer, or are just
+    //  counted (in link stats)
+    if( replay.peer )
+    {
+        while( (len = vlink_receive( VLINK_PEER, replay.sink, now_usec )) )
+            tcppeer_receive( replay.sink, len, now_usec );
+        tcppeer_poll( now_usec );
+    }
+    else
+    {
+        while( vlink_receive( VLINK_PEER, replay.sink, now_usec ) )
+            ;
+    }
+
+    // Stack end, once the stack has finished with the previous frame,
+    //  send the next frame out of the link up the stack, without the
+    //  ethernet header (as ether.c does). Measure how long processing
+    //  takes.
+    if( !msg->inuse )
+    {
+        msg->base   = replay.buf;
+        msg->size   = sizeof(replay.buf);
+        msg->offset = 20;
+        msg_clear( msg );
+        len = vlink_receive( VLINK_STACK, msg_ptr(msg), now_usec );
+        if( len >= ETH_OFFSET )
         {
-            printf( "Sending TCP MORE frame\n" );
-            memcpy( msg_ptr(msg), TCP_MORE, sizeof(TCP_MORE) );
-            msg_len(msg) = sizeof(TCP_MORE);
-            bmz_up( TASKID_IP, msg );
+            frame_type = (((u16)msg_ptr(msg)[12])<<8) + msg_ptr(msg)[13];
+            msg_len(msg) = len;
+
+            // Learn sender's ethernet address, as ether.c does
+            if( frame_type==FRAME_TYPE_IP && len>=ETH_OFFSET+20 &&
+                !(msg_ptr(msg)[0]&0x01) )
+            {
+                src_ipaddr = msg_read4( msg, ETH_OFFSET+12 );
+                if( ((src_ipaddr^config.my_ipaddr)&config.subnet_mask)==0 )
+                    arp_learn( src_ipaddr, msg_ptr(msg)+ETHADDR_LEN );
+            }
+            replay_ack( msg_ptr(msg), len, now_usec );
+            msg_pop( msg, ETH_OFFSET );
+            msg->inuse = MSG_INUSE_NORMAL;
+            replay.frames_injected++;
+            before = clock();
+            if( frame_type == FRAME_TYPE_IP )
+                bmz_up( TASKID_IP, msg );
+            else if( frame_type == FRAME_TYPE_ARP )
+                bmz_up( TASKID_ARP, msg );
+            else
+                msg_free( msg );
+            replay.cost += (clock()-before);
         }
-        else if( c == '4' )
+    }
+
+    // Finish when the input is done, or the live peer is
+    if( replay.eof )
+        replay_done();
+    if( replay.peer &&
+        ( tcppeer_done() || tick_get()-replay.peer_tick >= PEER_LIMIT ) )
+        peer_done();
+}
+
+// Read the next frame we want from the pcap file, returns false at end
+//  of file
+static bool replay_next()
+{
+    byte hdr[16];
+    byte *frame = replay.frame;
+    u32  caplen, len;
+    u16  frame_type;
+    double usec;
+    for(;;)
+    {
+        if( 1 != fread(hdr,sizeof(hdr),1,replay.in) )
+            return( false );
+        caplen = replay_read4(hdr+8);
+        len    = replay_read4(hdr+12);
+        usec   = replay_read4(hdr) * 1000000.0 +
+                    replay_read4(hdr+4) / (replay.nsec ? 1000.0 : 1.0);
+        if( caplen > REPLAY_MAXFRAME )
         {
-            printf( "Sending TCP SYN as received in the wild\n" );
-            memcpy( msg_ptr(msg), tcp_syn_from_real_world,
-                                         sizeof(tcp_syn_from_real_world) );
-            msg_len(msg) = sizeof(tcp_syn_from_real_world);
-            bmz_up( TASKID_IP, msg );
+            fseek( replay.in, caplen, SEEK_CUR );
+            replay.frames_skipped++;
+            continue;
         }
-        else if( c == '5' )
+        if( 1 != fread(frame,caplen,1,replay.in) )
+            return( false );
+        replay.frames_in++;
+        replay.bytes_in += caplen;
+        if( replay.first )
+            replay.first_usec = usec;
+
+        // Skip truncated frames, frames we sent, and frames the stack
+        //  doesn't handle
+        frame_type = ( caplen<ETH_OFFSET ? 0 :
+                            (((u16)frame[12])<<8) + frame[13] );
+        if( caplen < len ||
+            0 == memcmp( frame+ETHADDR_LEN, config.my_ethaddr, ETHADDR_LEN ) ||
+            ( frame_type!=FRAME_TYPE_IP &&
+              frame_type!=FRAME_TYPE_ARP
+            )
+          )
         {
-            printf( "Checking a TCP frame, is checksum okay?\n" );
-            printf( " (hint: it is but must hack tcp.c pseudo header code\n");
-            printf( "  because packet it doesn't know the dst IPADDR)\n" );
-            memcpy( msg_ptr(msg), tcp_is_this_okay1,
-                                                 sizeof(tcp_is_this_okay1) );
-            msg_len(msg) = sizeof(tcp_is_this_okay1);
-            bmz_up( TASKID_IP, msg );
+            replay.frames_skipped++;
+            continue;
         }
-        else if( c == '6' )
+        replay.len = (u16)caplen;
+        replay.due_usec = ( replay.speed ?
+                        (usec-replay.first_usec) / replay.speed : 0 );
+        replay.have_frame = true;
+        return( true );
+    }
+}
+
+// End of input, let the stack and link finish up then report and exit
+static void replay_done()
+{
+    VLINK_STATS stats;
+    byte end;
+    if( tick_get()-replay.eof_tick < REPLAY_LINGER || vlink_busy() )
+        return;
+    printf( "Replay: %lu frames (%lu bytes) read, %lu skipped\n",
+            replay.frames_in, replay.bytes_in, replay.frames_skipped );
+    printf( "Replay: %lu frames (%lu bytes) sent\n",
+            replay.frames_out, replay.bytes_out );
+    printf( "Replay: processing cost %.1f uS per injected frame\n",
+            replay.frames_injected ? ((double)replay.cost) * 1000000.0
+                    / CLOCKS_PER_SEC / replay.frames_injected : 0.0 );
+    for( end=0; end<VLINK_NBR_ENDS; end++ )
+    {
+        vlink_get_stats( end, &stats );
+        printf( "Link %s: %lu frames sent, %lu lost, %lu overflow, "
+                "%lu reordered, %lu delivered\n",
+                end==VLINK_STACK ? "stack->peer" : "peer->stack",
+                stats.frames_sent, stats.frames_lost,
+                stats.frames_overflow, stats.frames_reordered,
+                stats.frames_delivered );
+    }
+    if( replay.out )
+        fclose( replay.out );
+    fclose( replay.in );
+    exit(0);
+}
+
+// Live peer has finished, report and exit
+static void peer_done()
+{
+    TCPPEER_STATS peer;
+    VLINK_STATS stats;
+    double secs;
+    byte end;
+    tcppeer_get_stats( &peer );
+    secs = (peer.last_usec-peer.connect_usec) / 1000000.0;
+    printf( "Peer: %lu bytes in %lu segments received in order, "
+            "%lu discarded, %lu acks sent%s\n",
+            peer.bytes, peer.segments, peer.out_of_order, peer.acks_sent,
+            peer.reset ? ", reset by stack" : "" );
+    if( peer.bytes && secs>0.0 )
+        printf( "Peer: goodput %.0f bits/s\n", peer.bytes*8.0/secs );
+    printf( "Stack: %lu frames (%lu bytes) sent, %lu TCP retransmits\n",
+            replay.frames_out, replay.bytes_out, replay.retransmits );
+    if( replay.rtt_samples )
+        printf( "Stack: RTT %.0f/%.0f/%.0f uS min/avg/max, %lu samples\n",
+                replay.rtt_min, replay.rtt_total/replay.rtt_samples,
+                replay.rtt_max, replay.rtt_samples );
+    for( end=0; end<VLINK_NBR_ENDS; end++ )
+    {
+        vlink_get_stats( end, &stats );
+        printf( "Link %s: %lu frames sent, %lu lost, %lu overflow, "
+                "%lu reordered, %lu delivered\n",
+                end==VLINK_STACK ? "stack->peer" : "peer->stack",
+                stats.frames_sent, stats.frames_lost,
+                stats.frames_overflow, stats.frames_reordered,
+                stats.frames_delivered );
+    }
+    if( replay.out )
+        fclose( replay.out );
+    exit(0);
+}
+
+// Insert checksums the stack left to the link, as offload hardware
+//  would. The IP header checksum always, then the TCP, UDP or ICMP
+//  checksum of an unfragmented datagram.
+static void replay_insert_checksums( byte *frame, u16 len )
+{
+    byte *ip = frame + ETH_OFFSET;
+    byte pseudo[12];
+    u16  *poke;
+    u16  hlen, total_len, offset, checksum;
+    u32  sum=0;
+    if( len < ETH_OFFSET+20 ||
+        ((((u16)frame[12])<<8) + frame[13]) != FRAME_TYPE_IP
+      )
+        return;
+    hlen      = (ip[0]&0x0f) << 2;
+    total_len = (((u16)ip[2])<<8) + ip[3];
+    if( hlen<20 || total_len<hlen || len<ETH_OFFSET+total_len )
+        return;
+    poke  = (u16 *)( ip+10 );
+    *poke = 0;
+    *poke = checksum_calculate( ip, hlen );
+
+    // Transport checksum, ICMP has no pseudo header
+    if( (ip[6]&0x3f) || ip[7] )     // MF or fragment offset
+        return;
+    switch( ip[9] )
+    {
+        case PROTOCOL_ICMP: offset = 2;     break;
+        case PROTOCOL_TCP:  offset = 16;    break;
+        case PROTOCOL_UDP:  offset = 6;     break;
+        default:            return;
+    }
+    if( total_len-hlen < offset+2 )
+        return;
+    if( ip[9] != PROTOCOL_ICMP )
+    {
+        memcpy( pseudo, ip+12, 8 );
+        pseudo[8]  = 0;
+        pseudo[9]  = ip[9];
+        pseudo[10] = (byte)((total_len-hlen)>>8);
+        pseudo[11] = (byte)(total_len-hlen);
+        sum = checksum_partial( pseudo, sizeof(pseudo) );
+    }
+    poke  = (u16 *)( ip+hlen+offset );
+    *poke = 0;
+    checksum = checksum_fold( sum + checksum_partial(ip+hlen,total_len-hlen) );
+    if( checksum==0 && ip[9]==PROTOCOL_UDP )
+        checksum = 0xffff;          // zero means no checksum for UDP
+    *poke = checksum;
+}
+
+// Count TCP retransmissions sent by the stack, a segment with data (or
+//  SYN or FIN) that doesn't go beyond what has already been sent on its
+//  flow is a retransmission
+static void replay_flow( const byte *frame, u16 len, double now_usec )
+{
+    const byte *ip = frame + ETH_OFFSET;
+    const byte *tcp;
+    FLOW *f, *free_flow=NULL;
+    u16  src_port, dst_port, total_len, seg_len;
+    u32  seq_end, diff;
+    byte i, hlen, code_bits;
+    bool retransmit;
+    if( len < ETH_OFFSET+40 ||
+        ((((u16)frame[12])<<8) + frame[13]) != FRAME_TYPE_IP ||
+        ip[9] != PROTOCOL_TCP
+      )
+        return;
+    hlen      = (ip[0]&0x0f) << 2;
+    total_len = (((u16)ip[2])<<8) + ip[3];
+    tcp       = ip + hlen;
+    src_port  = (((u16)tcp[0])<<8) + tcp[1];
+    dst_port  = (((u16)tcp[2])<<8) + tcp[3];
+    code_bits = tcp[13];
+    seg_len   = total_len - hlen - ((tcp[12]>>4)<<2);
+    if( code_bits & (SYN_BIT|FIN_BIT) )
+        seg_len++;
+    if( seg_len == 0 )
+        return;     // pure ack
+    seq_end = (   (((u32)tcp[4])<<24) + (((u32)tcp[5])<<16)
+                + (((u32)tcp[6])<<8)  + tcp[7]
+              ) + seg_len;
+    seq_end &= 0xffffffff;
+    for( i=0, f=replay.flow; i<REPLAY_FLOWS; i++, f++ )
+    {
+        if( !f->inuse )
+            free_flow = f;
+        else if( f->src_port==src_port && f->dst_port==dst_port )
         {
-            printf( "Checking another TCP frame, is checksum okay?\n" );
-            printf( " (hint: it is but must hack tcp.c pseudo header code\n");
-            printf( "  because packet it doesn't know the dst IPADDR)\n" );
-            memcpy( msg_ptr(msg), tcp_is_this_okay2,
-                                             sizeof(tcp_is_this_okay2) );
-            msg_len(msg) = sizeof(tcp_is_this_okay2);
-            bmz_up( TASKID_IP, msg );
+            // A SYN starts the flow afresh unless it is a repeat, other
+            //  segments are repeats unless they reach beyond seq_end
+            //  (wraparound safe comparison)
+            diff = (seq_end - f->seq_end) & 0xffffffff;
+            if( code_bits & SYN_BIT )
+                retransmit = ( diff == 0 );
+            else
+                retransmit = ( diff==0 || (diff&0x80000000) );
+            if( retransmit )
+            {
+                replay.retransmits++;
+
+                // Don't time a segment that has been retransmitted, we
+                //  couldn't tell which copy the ack is for
+                if( replay.rtt_pending && replay.rtt_src_port==src_port &&
+                    replay.rtt_dst_port==dst_port )
+                    replay.rtt_pending = false;
+            }
+            else
+            {
+                f->seq_end = seq_end;
+
+                // Time this segment, if we aren't timing one already
+                if( !replay.rtt_pending )
+                {
+                    replay.rtt_pending    = true;
+                    replay.rtt_src_port   = src_port;
+                    replay.rtt_dst_port   = dst_port;
+                    replay.rtt_seq_end    = seq_end;
+                    replay.rtt_start_usec = now_usec;
+                }
+            }
+            return;
         }
     }
+    if( free_flow )
+    {
+        free_flow->inuse    = true;
+        free_flow->src_port = src_port;
+        free_flow->dst_port = dst_port;
+        free_flow->seq_end  = seq_end;
+    }
+}
+
+// An ack arriving at the stack that covers the segment being timed
+//  gives an RTT sample
+static void replay_ack( const byte *frame, u16 len, double now_usec )
+{
+    const byte *ip = frame + ETH_OFFSET;
+    const byte *tcp;
+    u32  ack_nbr, diff;
+    double rtt;
+    if( !replay.rtt_pending || len < ETH_OFFSET+40 ||
+        ((((u16)frame[12])<<8) + frame[13]) != FRAME_TYPE_IP ||
+        ip[9] != PROTOCOL_TCP
+      )
+        return;
+    tcp = ip + ((ip[0]&0x0f) << 2);
+    if( !(tcp[13] & ACK_BIT) ||
+        (((u16)tcp[0])<<8) + tcp[1] != replay.rtt_dst_port ||
+        (((u16)tcp[2])<<8) + tcp[3] != replay.rtt_src_port
+      )
+        return;
+    ack_nbr = (   (((u32)tcp[8])<<24) + (((u32)tcp[9])<<16)
+                + (((u32)tcp[10])<<8) + tcp[11]
+              );
+    diff = (ack_nbr - replay.rtt_seq_end) & 0xffffffff;
+    if( diff & 0x80000000 )
+        return;     // doesn't reach the timed segment yet
+    rtt = now_usec - replay.rtt_start_usec;
+    if( replay.rtt_samples==0 || rtt<replay.rtt_min )
+        replay.rtt_min = rtt;
+    if( replay.rtt_samples==0 || rtt>replay.rtt_max )
+        replay.rtt_max = rtt;
+    replay.rtt_total += rtt;
+    replay.rtt_samples++;
+    replay.rtt_pending = false;
+}
+
+// Host clock, microseconds
+static double host_usec()
+{
+    return( ((double)clock()) * 1000000.0 / CLOCKS_PER_SEC );
+}
+
+// Read u32 from pcap file header
+static u32 replay_read4( const byte *p )
+{
+    u32 dat = ((u32)p[0]) + (((u32)p[1])<<8) +
+                (((u32)p[2])<<16) + (((u32)p[3])<<24);
+    if( replay.swapped )
+        dat = ((u32)p[3]) + (((u32)p[2])<<8) +
+                (((u32)p[1])<<16) + (((u32)p[0])<<24);
+    return( dat );
+}
+
+// Write u32 to output pcap file
+static void replay_write4( u32 dat )
+{
+    replay_write2( (u16)dat );
+    replay_write2( (u16)(dat>>16) );
+}
+
+// Write u16 to output pcap file
+static void replay_write2( u16 dat )
+{
+    fputc( dat&0xff, replay.out );
+    fputc( (dat>>8)&0xff, replay.out );
 }
 
 // Not needed on PC
@@ -12,6 +12,7 @@
 #include "tcp.h"
 #include "ip.h"
 #include "icmp.h"
+#include "udp.h"
 #include "arp.h"
 #include "ether.h"
 #include "project.h"
@@ -55,8 +56,8 @@ static const TASK_DESCRIPTOR task_descriptors[] =
     // IP
     {   TASKID_IP,           // TASKID
         ip_init,             // init handler
-        NULL,                // idle handler
-        NULL,                // timeout handler
+        ip_idle,             // idle handler
+        ip_timeout,          // timeout handler
         ip_down,             // down handler
         ip_up,               // up handler
         0,                   // mq down depth
@@ -98,6 +99,21 @@ static const TASK_DESCRIPTOR task_descriptors[] =
         TASKID_TCPSOCK1      // share pool of this TASKID
     },
 
+    // UDP
+    {   TASKID_UDP,          // TASKID
+        udp_init,            // init handler
+        NULL,                // idle handler
+        NULL,                // timeout handler
+        udp_down,            // down handler
+        udp_up,              // up handler
+        0,                   // mq down depth
+        0,                   // mq up depth
+        0,                   // pool nbr
+        0,                   // pool len
+        0,                   // pool offset
+        TASKID_NULL          // share pool of this TASKID
+    },
+
     // TCPSOCK1
     {   TASKID_TCPSOCK1,     // TASKID
         tcpsock_init,        // init handler
@@ -188,7 +204,7 @@ const CONFIG config =
  *************************************************************************/
 int main()
 {
-    static byte buf[5364];  // Tune this so that BSS leaves some room for
+    static byte buf[6080];  // Tune this so that BSS leaves some room for
                             //  stack - consult map and leave about
                             //  0x300 bytes for stack
     byte *memory = buf;
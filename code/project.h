@@ -12,6 +12,11 @@
 
 // Define task ids
 //  Note: TASKID_NULL is #defined as 0 in bmz.h
+//  Note: There are two TCP connections, each a TCPSOCK task paired with
+//  a TCPAPP task (tserver, one per uart). TCPSOCKn pairs with TCPAPPn by
+//  position, so keep each pair of ids consecutive. A third connection
+//  needs its ids here, descriptors in project.c, a larger MAX_TASKS in
+//  bmz.c and a third tserver mapping.
 #define TASKID_TCPAPP1      1
 #define TASKID_TCPAPP2      2
 #define TASKID_TCPSOCK1     3
@@ -21,10 +26,11 @@
 #define TASKID_IP           7
 #define TASKID_ICMP         8
 #define TASKID_TCP          9
+#define TASKID_UDP          10
     // Note that order is significant. If task A feeds task B's queue, put
     // task A in front of task B (eg TCPAPP1 ahead of TCPSOCK1). Put tasks
     // without idle routines or queues last, the run loop will be shortened
-    // to exclude them (eg ARP,IP,ICMP and TCP)
+    // to exclude them (eg ARP,ICMP,TCP and UDP)
 
 // Hardwired configuration information
 typedef struct
@@ -9,7 +9,9 @@
 #include "bmz.h"
 #include "tcpip.h"
 #include "checksum.h"
+#include "ether.h"
 #include "tcpsock.h"
+#include "ip.h"
 #include "tcp.h"
 
 // Misc
@@ -26,6 +28,9 @@
 //      [ack_nbr,4]
 //      [code_bits,2]
 //      [window,2]
+//      [sum,4]        = sum of user data and of the header fields that
+//                        are fixed for the connection, as big endian
+//                        values (see checksum_host())
 //      [user data]
 // Message format out (down to IP);
 //      [ip protocol nbr,1]
@@ -33,7 +38,7 @@
 //      [payload] = [tcp segment] = [tcp hdr + tcp data]
 void tcp_down( MSG *msg )
 {
-    u16 segment_len, checksum, hlen_code_bits, *poke;
+    u16 segment_len, checksum, hlen_code_bits;
     byte hlen;
 
     // Take off parameters
@@ -44,36 +49,36 @@ void tcp_down( MSG *msg )
     u32    ack_nbr    = msg_pop4(msg);
     u16    code_bits  = msg_pop2(msg);
     u16    window     = msg_pop2(msg);
+    u32    sum        = msg_pop4(msg);
 
-    // Add tcp header
+    // Checksum, add the header fields that change from segment to segment
+    //  (including the length in the pseudo header), or leave it to the
+    //  link, or skip it if looped back
     hlen = STD_TCP_HEADER_LEN;       // hlen in bytes
     hlen >>= 2;                      // hlen in u32s
-    msg_push2( msg, 0 );             // urgent pointer
-    msg_push2( msg, 0 );             // checksum
-    msg_push2( msg, window );        // window
     hlen_code_bits = (u16)hlen;
     hlen_code_bits <<= 12;
     hlen_code_bits += code_bits;
+    segment_len = msg_len(msg) + STD_TCP_HEADER_LEN;
+    checksum = 0;
+    if( !ip_loopback(dst_ipaddr) &&
+        !(ether_get_caps() & ETHER_CAPS_TX_CSUM)
+      )
+        checksum = checksum_fold( sum + segment_len +
+                                  (u16)(seq_nbr>>16) + (u16)seq_nbr +
+                                  (u16)(ack_nbr>>16) + (u16)ack_nbr +
+                                  hlen_code_bits + window );
+
+    // Add tcp header
+    msg_push2( msg, 0 );             // urgent pointer
+    msg_push2( msg, checksum );      // checksum
+    msg_push2( msg, window );        // window
     msg_push2( msg, hlen_code_bits); // hlen, code bits
     msg_push4( msg, ack_nbr );       // ack nbr
     msg_push4( msg, seq_nbr );       // seq nbr
     msg_push2( msg, dst_port );      // dst port
     msg_push2( msg, src_port );      // src port
 
-    // Add pseudo header
-    segment_len = msg_len(msg);
-    msg_push2( msg, segment_len );
-    msg_push1( msg, PROTOCOL_TCP );
-    msg_push1( msg, 0 );
-    msg_push4( msg, dst_ipaddr );
-    msg_push4( msg, config.my_ipaddr );    // src ipaddr
-    checksum = checksum_calculate( msg_ptr(msg), msg_len(msg) );
-
-    // Remove pseudo header, insert checksum
-    msg_pop( msg, 12 );
-    poke  = (u16 *)( msg_ptr(msg) + 16 );
-    *poke = checksum;
-
     // Add output parameters
     msg_push4( msg, dst_ipaddr );
     msg_push1( msg, PROTOCOL_TCP );
@@ -87,6 +92,7 @@ void tcp_down( MSG *msg )
  * Message up
  *************************************************************************/
 // Message format in (up from IP);
+//      [loopback,1]
 //      [src_ipaddr,4]
 //      [payload] = [tcp segment] = [tcp hdr+tcp data]
 // Message format out (up to TCP_SOCKET);
@@ -107,6 +113,7 @@ void tcp_up( MSG *msg )
     u16    checksum;
 
     // Take off parameters
+    bool   loopback       = msg_pop1(msg);
     IPADDR rem_ipaddr     = msg_pop4(msg);
     u16    segment_len    = msg_len(msg);
 
@@ -123,8 +130,9 @@ void tcp_up( MSG *msg )
             err = true;
     }
 
-    // Add pseudo header
-    if( !err )
+    // Add pseudo header, to test checksum unless the link already has
+    //  (or it was looped back)
+    if( !err && !loopback && !(ether_get_caps()&ETHER_CAPS_RX_CSUM) )
     {
         msg_push2( msg, segment_len );
         msg_push1( msg, PROTOCOL_TCP );
@@ -186,19 +194,26 @@ void tcp_up( MSG *msg )
                 msg_push2( msg, rem_port );      // dst port
                 msg_push2( msg, loc_port );      // src port
 
-                // Add pseudo header
-                segment_len = msg_len(msg);
-                msg_push2( msg, segment_len );
-                msg_push1( msg, PROTOCOL_TCP );
-                msg_push1( msg, 0 );
-                msg_push4( msg, rem_ipaddr );           // dst ipaddr
-                msg_push4( msg, config.my_ipaddr );     // src ipaddr
-                checksum = checksum_calculate( msg_ptr(msg), msg_len(msg) );
-
-                // Remove pseudo header, insert checksum
-                msg_pop( msg, 12 );
-                poke  = (u16 *)( msg_ptr(msg) + 16 );
-                *poke = checksum;
+                // Checksum, unless the link inserts it or it goes back
+                //  round the loop
+                if( !loopback && !(ether_get_caps() & ETHER_CAPS_TX_CSUM) )
+                {
+
+                    // Add pseudo header
+                    segment_len = msg_len(msg);
+                    msg_push2( msg, segment_len );
+                    msg_push1( msg, PROTOCOL_TCP );
+                    msg_push1( msg, 0 );
+                    msg_push4( msg, rem_ipaddr );       // dst ipaddr
+                    msg_push4( msg, config.my_ipaddr ); // src ipaddr
+                    checksum = checksum_calculate( msg_ptr(msg),
+                                                   msg_len(msg) );
+
+                    // Remove pseudo header, insert checksum
+                    msg_pop( msg, 12 );
+                    poke  = (u16 *)( msg_ptr(msg) + 16 );
+                    *poke = checksum;
+                }
 
                 // Add output parameters
                 msg_push4( msg, rem_ipaddr );
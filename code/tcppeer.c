@@ -0,0 +1,310 @@
+/*************************************************************************
+ * tcppeer.c
+ *
+ *  Minimal reactive TCP peer at the far end of the virtual link, for the
+ *  PC hosted build
+ *  Project: eZ2944
+ *************************************************************************/
+#include <string.h>
+#include "project.h"
+#include "bmz.h"
+#include "tcpip.h"
+#include "checksum.h"
+#include "vlink.h"
+#include "tcppeer.h"
+
+// The peer is just enough of a TCP receiver to make the stack behave as
+//  it would against a real host. It answers ARP, connects to the stack,
+//  then acks every segment that arrives. Data is only accepted in order
+//  (no out of order queue, so a lost segment costs the stack a
+//  retransmission, as it should) and consumed at once, so the window
+//  never closes. It never sends data of its own.
+// It stands in for a second BMZ stack, which can't share a process with
+//  the first since every BMZ module keeps its state in module statics.
+
+// Misc
+#define PEER_HOST       9           // peer's host nbr on our subnet
+#define PEER_PORT       5000        // peer's TCP port
+#define PEER_ISS        1000        // peer's initial sequence nbr
+#define PEER_WINDOW     4096
+#define PEER_SYN_RETRY  1000000.0   // uS between SYNs
+#define TCP_HEADER_LEN  20
+#define IP_HEADER_LEN   20
+
+// Peer state
+typedef enum
+{
+    PEER_SYN_SENT,
+    PEER_ESTABLISHED,
+    PEER_DONE
+} PEER_STATE;
+
+// Module data
+typedef struct
+{
+    PEER_STATE    state;
+    IPADDR        ipaddr;       // peer's
+    u16           port;         // stack's
+    u32           nbr_bytes;    // to receive before we're done
+    u32           rcv_nxt;      // next sequence nbr expected
+    u16           identification;
+    double        syn_due_usec;
+    byte          frame[ETH_MINFRAME];
+    TCPPEER_STATS stats;
+} TCPPEER;
+static TCPPEER z;
+
+// Peer's ethernet address
+static const byte peer_ethaddr[ETHADDR_LEN] = { 0x02,0,0,0,0,PEER_HOST };
+
+// Local prototypes
+static void send_arp_reply( const byte *req, double now_usec );
+static void send_segment( byte code_bits, double now_usec );
+static u16  get2( const byte *p );
+static u32  get4( const byte *p );
+static void put2( byte *p, u16 dat );
+static void put4( byte *p, u32 dat );
+
+/*************************************************************************
+ * Setup peer
+ *************************************************************************/
+void tcppeer_init( u16 port, u32 nbr_bytes )
+{
+    memset( &z, 0, sizeof(z) );
+    z.state     = PEER_SYN_SENT;
+    z.ipaddr    = (config.my_ipaddr & config.subnet_mask) | PEER_HOST;
+    z.port      = port;
+    z.nbr_bytes = nbr_bytes;
+}
+
+/*************************************************************************
+ * Frame arriving at the peer end of the link
+ *************************************************************************/
+void tcppeer_receive( const byte *frame, u16 len, double now_usec )
+{
+    const byte *ip  = frame + ETH_OFFSET;
+    const byte *tcp;
+    u16  frame_type, total_len, seg_len, hlen;
+    u32  seq_nbr, ack_nbr, diff;
+    byte code_bits;
+    if( len < ETH_OFFSET )
+        return;
+    frame_type = get2( frame+ETH_OFFSET-2 );
+
+    // ARP request for us ?
+    if( frame_type == FRAME_TYPE_ARP )
+    {
+        if( len >= ETH_OFFSET+28 && get2(ip+6)==1 &&
+            get4(ip+24) == z.ipaddr
+          )
+            send_arp_reply( ip, now_usec );
+        return;
+    }
+
+    // Otherwise only TCP segments on our connection interest us
+    if( frame_type!=FRAME_TYPE_IP || len<ETH_OFFSET+IP_HEADER_LEN ||
+        ip[9]!=PROTOCOL_TCP || get4(ip+16)!=z.ipaddr
+      )
+        return;
+    hlen      = (ip[0]&0x0f) << 2;
+    total_len = get2( ip+2 );
+    if( total_len < hlen+TCP_HEADER_LEN || len < ETH_OFFSET+total_len )
+        return;
+    tcp = ip + hlen;
+    if( get2(tcp)!=z.port || get2(tcp+2)!=PEER_PORT )
+        return;
+    seq_nbr   = get4( tcp+4 );
+    ack_nbr   = get4( tcp+8 );
+    code_bits = tcp[13];
+    seg_len   = total_len - hlen - ((tcp[12]>>4)<<2);
+
+    // Reset ends the run
+    if( code_bits & RST_BIT )
+    {
+        z.stats.reset = true;
+        z.state = PEER_DONE;
+        return;
+    }
+    switch( z.state )
+    {
+        case PEER_SYN_SENT:
+        {
+            if( (code_bits&(SYN_BIT|ACK_BIT)) == (SYN_BIT|ACK_BIT) &&
+                ack_nbr == PEER_ISS+1
+              )
+            {
+                z.rcv_nxt = (seq_nbr+1) & 0xffffffff;
+                z.state   = PEER_ESTABLISHED;
+                z.stats.connect_usec = now_usec;
+                send_segment( ACK_BIT, now_usec );
+            }
+            break;
+        }
+        case PEER_ESTABLISHED:
+        {
+            // Take whatever is new, in order, repeats and segments
+            //  beyond a gap are discarded
+            if( seg_len )
+            {
+                diff = (z.rcv_nxt - seq_nbr) & 0xffffffff;
+                if( diff < seg_len )
+                {
+                    z.rcv_nxt = (z.rcv_nxt + seg_len-diff) & 0xffffffff;
+                    z.stats.bytes += seg_len-diff;
+                    z.stats.segments++;
+                    z.stats.last_usec = now_usec;
+                }
+                else
+                    z.stats.out_of_order++;
+            }
+            if( (code_bits&FIN_BIT) &&
+                ((seq_nbr+seg_len)&0xffffffff) == z.rcv_nxt
+              )
+                z.rcv_nxt = (z.rcv_nxt+1) & 0xffffffff;
+
+            // Ack anything that takes up sequence space, and repeated
+            //  SYN-ACKs (our ack was lost)
+            if( seg_len || (code_bits&(SYN_BIT|FIN_BIT)) )
+                send_segment( ACK_BIT, now_usec );
+            if( z.stats.bytes >= z.nbr_bytes )
+                z.state = PEER_DONE;
+            break;
+        }
+        case PEER_DONE:
+        {
+            break;  // finished, ignore anything more
+        }
+    }
+}
+
+/*************************************************************************
+ * Send anything the peer needs to send on its own
+ *************************************************************************/
+void tcppeer_poll( double now_usec )
+{
+    if( z.state==PEER_SYN_SENT && now_usec>=z.syn_due_usec )
+    {
+        send_segment( SYN_BIT, now_usec );
+        z.syn_due_usec = now_usec + PEER_SYN_RETRY;
+    }
+}
+
+/*************************************************************************
+ * Test whether the peer has finished
+ *************************************************************************/
+bool tcppeer_done()
+{
+    return( z.state == PEER_DONE );
+}
+
+/*************************************************************************
+ * Get statistics
+ *************************************************************************/
+void tcppeer_get_stats( TCPPEER_STATS *stats )
+{
+    *stats = z.stats;
+}
+
+/*************************************************************************
+ * Reply to an ARP request for our address
+ *************************************************************************/
+static void send_arp_reply( const byte *req, double now_usec )
+{
+    byte *f = z.frame;
+    byte *arp = f + ETH_OFFSET;
+    memset( f, 0, sizeof(z.frame) );
+    memcpy( f, req+8, ETHADDR_LEN );                    // dst = sender
+    memcpy( f+ETHADDR_LEN, peer_ethaddr, ETHADDR_LEN );
+    put2( f+ETH_OFFSET-2, FRAME_TYPE_ARP );
+    put2( arp,   1 );                                   // ethernet
+    put2( arp+2, FRAME_TYPE_IP );
+    arp[4] = ETHADDR_LEN;
+    arp[5] = IPADDR_LEN;
+    put2( arp+6, 2 );                                   // reply
+    memcpy( arp+8, peer_ethaddr, ETHADDR_LEN );
+    put4( arp+14, z.ipaddr );
+    memcpy( arp+18, req+8, ETHADDR_LEN+IPADDR_LEN );    // target = sender
+    vlink_send( VLINK_PEER, f, ETH_MINFRAME, now_usec );
+}
+
+/*************************************************************************
+ * Send a segment without data to the stack
+ *************************************************************************/
+static void send_segment( byte code_bits, double now_usec )
+{
+    byte *f   = z.frame;
+    byte *ip  = f + ETH_OFFSET;
+    byte *tcp = ip + IP_HEADER_LEN;
+    byte pseudo[12+TCP_HEADER_LEN];
+    u16  *poke;
+
+    // Ethernet and IP headers
+    memset( f, 0, sizeof(z.frame) );
+    memcpy( f, config.my_ethaddr, ETHADDR_LEN );
+    memcpy( f+ETHADDR_LEN, peer_ethaddr, ETHADDR_LEN );
+    put2( f+ETH_OFFSET-2, FRAME_TYPE_IP );
+    put2( ip,    0x4500 );
+    put2( ip+2,  IP_HEADER_LEN+TCP_HEADER_LEN );
+    put2( ip+4,  z.identification++ );
+    ip[8] = 64;                                         // ttl
+    ip[9] = PROTOCOL_TCP;
+    put4( ip+12, z.ipaddr );
+    put4( ip+16, config.my_ipaddr );
+    poke  = (u16 *)( ip+10 );
+    *poke = checksum_calculate( ip, IP_HEADER_LEN );
+
+    // TCP header, checksummed with a pseudo header in front
+    put2( tcp,   PEER_PORT );
+    put2( tcp+2, z.port );
+    put4( tcp+4, (code_bits&SYN_BIT) ? PEER_ISS : PEER_ISS+1 );
+    put4( tcp+8, (code_bits&ACK_BIT) ? z.rcv_nxt : 0 );
+    tcp[12] = (TCP_HEADER_LEN/4) << 4;
+    tcp[13] = code_bits;
+    put2( tcp+14, PEER_WINDOW );
+    memcpy( pseudo, ip+12, 8 );
+    pseudo[8] = 0;
+    pseudo[9] = PROTOCOL_TCP;
+    put2( pseudo+10, TCP_HEADER_LEN );
+    memcpy( pseudo+12, tcp, TCP_HEADER_LEN );
+    poke  = (u16 *)( tcp+16 );
+    *poke = checksum_calculate( pseudo, sizeof(pseudo) );
+    if( code_bits & SYN_BIT )
+        z.stats.syns_sent++;
+    else
+        z.stats.acks_sent++;
+    vlink_send( VLINK_PEER, f, ETH_MINFRAME, now_usec );
+}
+
+/*************************************************************************
+ * Read big endian u16
+ *************************************************************************/
+static u16 get2( const byte *p )
+{
+    return( (((u16)p[0])<<8) | (u16)p[1] );
+}
+
+/*************************************************************************
+ * Read big endian u32
+ *************************************************************************/
+static u32 get4( const byte *p )
+{
+    return( (((u32)get2(p))<<16) | (u32)get2(p+2) );
+}
+
+/*************************************************************************
+ * Write big endian u16
+ *************************************************************************/
+static void put2( byte *p, u16 dat )
+{
+    p[0] = (byte)(dat>>8);
+    p[1] = (byte)dat;
+}
+
+/*************************************************************************
+ * Write big endian u32
+ *************************************************************************/
+static void put4( byte *p, u32 dat )
+{
+    put2( p,   (u16)(dat>>16) );
+    put2( p+2, (u16)dat );
+}
@@ -0,0 +1,40 @@
+/*************************************************************************
+ * tcppeer.h
+ *
+ *  Minimal reactive TCP peer at the far end of the virtual link, for the
+ *  PC hosted build
+ *  Project: eZ2944
+ *************************************************************************/
+#ifndef TCPPEER_H
+#define TCPPEER_H
+#include "bmz.h"
+
+// Peer statistics
+typedef struct
+{
+    u32    syns_sent;
+    u32    acks_sent;
+    u32    segments;        // data segments received
+    u32    out_of_order;    // data segments discarded, not next in order
+    u32    bytes;           // user data received in order
+    double connect_usec;    // when the connection was established
+    double last_usec;       // when the last in order data arrived
+    bool   reset;           // connection reset by the stack
+} TCPPEER_STATS;
+
+// Setup peer, it will connect to port on the stack and receive nbr_bytes
+void tcppeer_init( u16 port, u32 nbr_bytes );
+
+// Frame arriving at the peer end of the link
+void tcppeer_receive( const byte *frame, u16 len, double now_usec );
+
+// Send anything the peer needs to send on its own (SYN retries)
+void tcppeer_poll( double now_usec );
+
+// Test whether the peer has finished, all bytes received or reset
+bool tcppeer_done();
+
+// Get statistics
+void tcppeer_get_stats( TCPPEER_STATS *stats );
+
+#endif  // TCPPEER_H
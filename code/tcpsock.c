@@ -10,7 +10,7 @@
 #include "bmz.h"
 #include "tcpip.h"
 #include "checksum.h"
-#include "ether.h"      // for ether_rx_room()
+#include "ether.h"      // for ether_rx_room(), ether_get_caps()
 #include "tcpsock.h"
 
 // TCP applications can hook this function for special features (eg
@@ -67,8 +67,16 @@ typedef enum
 // Misc
 #define WINDOW_RX   1000
 #define TIMER_2MSL  60
+#define TIMER_2MSL_SLACK 10
 #define TX_BUF_SIZE 1000
 
+// The delayed ack and retry timers run at hi res tick resolution, and the
+//  rtt calculations are done in hi res ticks
+#define DELAYED_ACK_TIME    US_TO_TICKS_HI_RES(40000UL)     // 40mS
+#define DELAYED_ACK_SLACK   US_TO_TICKS_HI_RES(20000UL)     // +20mS
+#define RTO_MIN             US_TO_TICKS_HI_RES(200000UL)    // 200mS
+#define RTO_MAX             (60*TICKS_PER_SECOND_HI_RES)    // 60 seconds
+
 // Timer IDs
 #define TIMER_ID_RETRY       0
 #define TIMER_ID_DELAYED_ACK 1
@@ -122,9 +130,34 @@ static const u16 backoff_array[] =
     1, 2, 4, 8, 16, 32, 64, 128
 };
 
+// Incoming segments find their socket through a table shared by all the
+//  TCPSOCK tasks. Connections are kept in hash chains, hashed on
+//  (loc_port, rem_port, rem_ipaddr), and listening sockets in a separate
+//  list that is only searched if no connection matches. Where a socket
+//  is in the table follows its state, see table_update().
+#define TCPSOCK_HASH(loc_port,rem_port,rem_ipaddr)              \
+    ( ( (loc_port) ^ (rem_port) ^ (u16)((rem_ipaddr)>>16) ^     \
+        (u16)(rem_ipaddr) ) & (TCPSOCK_HASH_NBR-1) )
+#define SOCKET(taskid) ( (TCPSOCK *)bmz_get_instance(taskid) )
+#define TABLE_NONE      0       // not in table
+#define TABLE_LISTEN    1       // in listen list
+#define TABLE_HASH      2       // in a hash chain
+
+// Socket table
+typedef struct
+{
+    TASKID  hash[TCPSOCK_HASH_NBR]; // first socket in each hash chain
+    TASKID  listen;                 // first listening socket
+} TABLE;
+static TABLE table;
+
 // Module data
 typedef struct
 {
+    TASKID      taskid;         // our TCPSOCK task
+    byte        table;          // where we are in socket table
+    byte        bucket;         //  which hash chain
+    TASKID      next;           // next socket in chain or list
     byte        state;
     byte        ack_phase;
     bool        send_ack;
@@ -146,6 +179,8 @@ typedef struct
     u16         loc_port;
     u16         rem_port;
     IPADDR      rem_ipaddr;
+    u32         hdr_sum;        // sum of TCP header and pseudo header
+                                //  fields that are fixed for the connection
     u32         rtt_rto_previous;
     u32         rtt_estimate;
     u32         rtt_mean_deviation;
@@ -157,6 +192,8 @@ typedef struct
 
 // Local prototypes
 static void tcpsock_reset( TCPSOCK *z );
+static void header_template( TCPSOCK *z );
+static void table_update( TCPSOCK *z );
 static ACTION connection_state_machine( TCPSOCK *z, EVENT event );
 static void tx_process( TCPSOCK *z, ACTION action );
 static void rtt_calculation( TCPSOCK *z, u32 sample );
@@ -178,6 +215,8 @@ void *tcpsock_init( byte **addr_mem, u16 *addr_len )
         z        = (TCPSOCK *)memory;
         memory  += sizeof(TCPSOCK);
         memlen  -= sizeof(TCPSOCK);
+        z->taskid  = bmz_get_current_taskid();
+        z->table   = TABLE_NONE;
         z->tx_size = TX_BUF_SIZE;
         if( memlen < z->tx_size )
             bmz_panic_memory("tcpsock");
@@ -233,6 +272,8 @@ void tcpsock_down( MSG *msg )
                 z->loc_port   = msg_pop2(msg);
                 z->rem_port   = msg_pop2(msg);
                 z->rem_ipaddr = msg_pop4(msg);
+                header_template( z );
+                table_update( z );
             }
             break;
         }
@@ -416,7 +457,8 @@ void tcpsock_up( MSG *msg )
                             z->tx_get = z->tx_buf + (z->tx_get-z->tx_end);
                         if( !z->rtt_retry_pending )
                         {
-                            u32 sample = tick_get()-z->rtt_start_time;
+                            u32 sample = tick_get_hi_res() -
+                                                         z->rtt_start_time;
                             rtt_calculation( z, sample );
                             z->rtt_updated = true;
                             z->backoff_index = 0;
@@ -489,7 +531,8 @@ void tcpsock_up( MSG *msg )
             msg_push1( msg, MSG_TYPE_DATA );
             bmz_up( z->taskid_app, msg );
             if( !timer_running(&z->timer_delayed_ack) )
-                timer_start_ticks( &z->timer_delayed_ack, 3 );
+                timer_start_hi_res_slack( &z->timer_delayed_ack,
+                              DELAYED_ACK_TIME, (u16)DELAYED_ACK_SLACK );
             z->delayed_ack_pending = true;
         }
         else if( z->rx_seq!=seq_nbr )
@@ -548,37 +591,44 @@ void tcpsock_timeout( byte timer_id )
  *************************************************************************/
 TASKID tcpsock_select( u16 loc_port, u16 rem_port, IPADDR rem_ipaddr )
 {
-    int i;
     TASKID taskid, found=TASKID_NULL;
     TCPSOCK *z;
-    for( i=0, taskid=TASKID_TCPSOCK1; i<2 && found==TASKID_NULL;
-                                             i++, taskid=TASKID_TCPSOCK2 )
+
+    // A connection ?
+    taskid = table.hash[ TCPSOCK_HASH(loc_port,rem_port,rem_ipaddr) ];
+    while( taskid!=TASKID_NULL && found==TASKID_NULL )
+    {
+        z = SOCKET(taskid);
+        if( z->loc_port    == loc_port &&
+            z->rem_port    == rem_port &&
+            z->rem_ipaddr  == rem_ipaddr
+          )
+            found = taskid;
+        taskid = z->next;
+    }
+
+    // If not, a listening socket. It stays in the listen list until
+    //  the segment moves it out of ST_LISTEN
+    taskid = table.listen;
+    while( taskid!=TASKID_NULL && found==TASKID_NULL )
     {
-        z = bmz_get_instance(taskid);
-        if( z->state == ST_LISTEN )
+        z = SOCKET(taskid);
+        if( tcpapp_listen_callback(z->loc_port,loc_port) )
         {
-            if( tcpapp_listen_callback(z->loc_port,loc_port) )
-            {
-                found = taskid;
-                z->loc_port   = loc_port;
-                z->rem_port   = rem_port;
-                z->rem_ipaddr = rem_ipaddr;
-            }
-            else if( z->loc_port==loc_port )
-            {
-                found = taskid;
-                z->rem_port   = rem_port;
-                z->rem_ipaddr = rem_ipaddr;
-            }
+            found = taskid;
+            z->loc_port   = loc_port;
+            z->rem_port   = rem_port;
+            z->rem_ipaddr = rem_ipaddr;
+            header_template( z );
         }
-        else
+        else if( z->loc_port==loc_port )
         {
-            if( z->loc_port    == loc_port &&
-                z->rem_port    == rem_port &&
-                z->rem_ipaddr  == rem_ipaddr
-              )
-                found = taskid;
+            found = taskid;
+            z->rem_port   = rem_port;
+            z->rem_ipaddr = rem_ipaddr;
+            header_template( z );
         }
+        taskid = z->next;
     }
     return( found );
 }
@@ -748,12 +798,15 @@ static ACTION connection_state_machine( TCPSOCK *z, EVENT event )
             }
             case ST_TIMED_WAIT:
             {
-                timer_start_seconds( &z->timer_retry, TIMER_2MSL );
+                timer_start_seconds_slack( &z->timer_retry, TIMER_2MSL,
+                                                     TIMER_2MSL_SLACK );
                 break;
             }
         }
     }
     z->state = state;
+    if( state != oldstate )
+        table_update( z );
     return( action );
 }
 
@@ -765,8 +818,8 @@ static void tx_process( TCPSOCK *z, ACTION action )
 {
     static u32 nbr_connections;
     MSG *msg;
-    u16  timeout, nbr, nbr_sent=0, phase1, window, code_bits;
-    u32  ack_nbr, tx_seq;
+    u16  nbr, nbr_sent=0, phase1, window, code_bits;
+    u32  ack_nbr, tx_seq, timeout, data_sum;
     byte *get;
     long temp;
     bool wait_for_later=false;
@@ -774,6 +827,7 @@ static void tx_process( TCPSOCK *z, ACTION action )
     bool send_syn =false;
     bool send_fin =false;
     bool send_data=false;
+    bool offload = ( (ether_get_caps()&ETHER_CAPS_TX_CSUM) ? true : false );
 
     // Is it time to send data ?
     if( z->ack_phase == ACK_DATA   &&
@@ -784,7 +838,7 @@ static void tx_process( TCPSOCK *z, ACTION action )
         send_data = true;
         if( z->tx_unacked == 0 )
         {
-            z->rtt_start_time    = tick_get();
+            z->rtt_start_time    = tick_get_hi_res();
             z->rtt_retry_pending = false;
         }
         else
@@ -856,6 +910,7 @@ static void tx_process( TCPSOCK *z, ACTION action )
             msg = pool_alloc( bmz_get_current_pool() );
             if( !msg )
                 break;  // normal TCP procedures will retry
+            data_sum = 0;
             if( send_data )
             {
                 if( z->tx_put >= get )
@@ -868,20 +923,35 @@ static void tx_process( TCPSOCK *z, ACTION action )
                     nbr = msg_room(msg);
                 else
                     send_data = false;  // no more to send
+
+                // Copy data, calculating its checksum as we go so TCP
+                //  only needs to checksum the header (just copy it if the
+                //  link inserts checksums)
                 phase1 = z->tx_end-get;
                 if( phase1 >= nbr )
                 {
-                    memcpy( msg_ptr(msg), get, nbr );
+                    if( offload )
+                        memcpy( msg_ptr(msg), get, nbr );
+                    else
+                        data_sum = checksum_copy( msg_ptr(msg), get, nbr );
                     get += nbr;
                     if( get == z->tx_end )
                         get = z->tx_buf;
                 }
-                else
+                else if( offload )
                 {
                     memcpy( msg_ptr(msg), get, phase1 );
                     memcpy( msg_ptr(msg)+phase1, z->tx_buf, nbr-phase1 );
                     get = z->tx_buf + nbr-phase1;
                 }
+                else
+                {
+                    data_sum = checksum_copy( msg_ptr(msg), get, phase1 );
+                    data_sum = checksum_combine( data_sum,
+                        checksum_copy( msg_ptr(msg)+phase1, z->tx_buf,
+                                                      nbr-phase1 ), phase1 );
+                    get = z->tx_buf + nbr-phase1;
+                }
                 msg_len(msg) += nbr;    // assumes msg_len() is a macro
                 nbr_sent     += nbr;
             }
@@ -894,6 +964,7 @@ static void tx_process( TCPSOCK *z, ACTION action )
             //      [ack_nbr,4]
             //      [code_bits,2]
             //      [window,2]
+            //      [sum,4]
             //      [user data]
             if( !z->send_ack )
             {
@@ -938,6 +1009,7 @@ static void tx_process( TCPSOCK *z, ACTION action )
                 code_bits |= PSH_BIT;
 
             // Add parameters
+            msg_push4( msg, checksum_host(data_sum) + z->hdr_sum );
             msg_push2( msg, window );
             msg_push2( msg, code_bits );
             msg_push4( msg, ack_nbr );
@@ -974,14 +1046,18 @@ static void tx_process( TCPSOCK *z, ACTION action )
             // MD  = mean deviation of samples used for rtt calculation
             if( z->rtt_updated )
             {
-                timeout = (u16)(z->rtt_estimate + (z->rtt_mean_deviation<<2));
+                timeout = z->rtt_estimate + (z->rtt_mean_deviation<<2);
+                if( timeout < RTO_MIN )
+                    timeout = RTO_MIN;
+                else if( timeout > RTO_MAX )
+                    timeout = RTO_MAX;
                 z->rtt_rto_previous = timeout;
             }
 
             // But if last ack didn't update rtt, retain current value of
             //  timeout instead
             else
-                timeout = (u16)z->rtt_rto_previous;
+                timeout = z->rtt_rto_previous;
 
             // And multiply by a backoff factor
             if( z->backoff_index < 0 )
@@ -989,11 +1065,13 @@ static void tx_process( TCPSOCK *z, ACTION action )
             else if( z->backoff_index >= nbrof(backoff_array) )
                 z->backoff_index = nbrof(backoff_array)-1;
             timeout *= backoff_array[z->backoff_index++];
+            if( timeout > RTO_MAX )
+                timeout = RTO_MAX;
             #ifdef DEBUG_TCP_START_RETRY
-            printf( "%u ticks, rtt=%u, md=%u\n", (u16)timeout+1,
-                         (u16)z->rtt_estimate, (u16)z->rtt_mean_deviation );
+            printf( "%lu hi res ticks, rtt=%lu, md=%lu\n", timeout,
+                                z->rtt_estimate, z->rtt_mean_deviation );
             #endif
-            timer_start_ticks( &z->timer_retry, (u32)timeout+1 ); //round up
+            timer_start_hi_res( &z->timer_retry, timeout );
         }
     }
 }
@@ -1010,10 +1088,7 @@ static void tcpsock_reset( TCPSOCK *z )
     z->state = ST_CLOSED;
     timer_reset( &z->timer_retry,       TIMER_ID_RETRY );
     timer_reset( &z->timer_delayed_ack, TIMER_ID_DELAYED_ACK );
-    if( bmz_get_current_taskid() == TASKID_TCPSOCK1 )
-        z->taskid_app = TASKID_TCPAPP1;
-    else
-        z->taskid_app = TASKID_TCPAPP2;
+    z->taskid_app = TASKID_TCPAPP1 + (z->taskid-TASKID_TCPSOCK1);
     z->tx_seq               = 0;
     z->rx_seq               = 0;
     z->tx_unacked           = 0;
@@ -1023,17 +1098,84 @@ static void tcpsock_reset( TCPSOCK *z )
     z->loc_port             = 0;
     z->rem_port             = 0;
     z->rem_ipaddr           = 0;
+    z->hdr_sum              = 0;
     z->ack_phase            = ACK_IDLE;
     z->send_ack             = false;
     z->delayed_ack_pending  = false;
-    z->rtt_rto_previous     = SECS_TO_TICKS(1);
-    z->rtt_estimate         = SECS_TO_TICKS(1);
-    z->rtt_mean_deviation   = SECS_TO_TICKS(0);
+    z->rtt_rto_previous     = TICKS_PER_SECOND_HI_RES;
+    z->rtt_estimate         = TICKS_PER_SECOND_HI_RES;
+    z->rtt_mean_deviation   = 0;
     z->rtt_updated          = false;
     z->rtt_retry_pending    = false;
     z->rtt_start_time       = 0;
     z->tx_push              = false;
     bmz_set_publish_state( PUBLISH_IDLE );
+    table_update( z );
+}
+
+
+/*************************************************************************
+ * Sum the header fields that stay the same for the whole connection, so
+ *  TCP only needs to add the fields that change to get the checksum
+ *************************************************************************/
+static void header_template( TCPSOCK *z )
+{
+    z->hdr_sum = (u32)(u16)(config.my_ipaddr>>16) + (u16)config.my_ipaddr
+               + (u16)(z->rem_ipaddr>>16) + (u16)z->rem_ipaddr
+               + PROTOCOL_TCP + z->loc_port + z->rem_port;
+}
+
+
+/*************************************************************************
+ * Put socket in the right place in the socket table for its state
+ *************************************************************************/
+// Listening sockets go in the listen list, in TASKID order so the first
+//  TCPSOCK gets first refusal as before. Sockets with a connection (or
+//  trying to make one) go in the hash chain for their addressing, which
+//  doesn't change while they are there. Closed sockets aren't in the
+//  table.
+static void table_update( TCPSOCK *z )
+{
+    TASKID *link;
+    byte want=TABLE_NONE, bucket=0;
+    if( z->state == ST_LISTEN )
+        want = TABLE_LISTEN;
+    else if( z->state != ST_CLOSED )
+    {
+        want   = TABLE_HASH;
+        bucket = TCPSOCK_HASH( z->loc_port, z->rem_port, z->rem_ipaddr );
+    }
+
+    // Already in the right place ?
+    if( want==z->table && (want!=TABLE_HASH || bucket==z->bucket) )
+        return;
+
+    // Unlink from old place
+    if( z->table != TABLE_NONE )
+    {
+        link = ( z->table==TABLE_LISTEN ? &table.listen
+                                        : &table.hash[z->bucket] );
+        while( *link != z->taskid )
+            link = &SOCKET(*link)->next;
+        *link = z->next;
+    }
+
+    // Link into new place
+    z->table  = want;
+    z->bucket = bucket;
+    if( want == TABLE_LISTEN )
+    {
+        link = &table.listen;
+        while( *link!=TASKID_NULL && *link<z->taskid )
+            link = &SOCKET(*link)->next;
+        z->next = *link;
+        *link   = z->taskid;
+    }
+    else if( want == TABLE_HASH )
+    {
+        z->next = table.hash[bucket];
+        table.hash[bucket] = z->taskid;
+    }
 }
 
 
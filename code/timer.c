@@ -10,12 +10,40 @@
 #include "console.h"
 #include "tick.h"
 
+// Running timers are kept on a list sorted by expiry time, earliest
+//  first. Timers store an absolute expiry tick rather than a count of
+//  remaining ticks, so nothing needs to be updated as time passes, and
+//  a heartbeat with nothing to do costs a single comparison against the
+//  head of the list.
+// There are two classes of timer, each with its own list. Regular timers
+//  count heartbeat ticks (TICKS_PER_SECOND), hi res timers count hi res
+//  ticks (TICKS_PER_SECOND_HI_RES) and are checked on every pass of the
+//  BMZ run loop rather than once per heartbeat.
+// A timer started with slack can expire anywhere in a window that closes
+//  at its expiry tick and opens slack ticks earlier. The list is sorted by
+//  the closing tick, so a wakeup only happens when some timer can wait no
+//  longer, and then every timer whose window is already open expires
+//  along with it. This groups timers with nearby expiries into a single
+//  wakeup. Timers without slack behave exactly as before.
+
+// Compare tick counts in a way that survives wraparound
+#define BEFORE_OR_AT(a,b)   ( (long)((a)-(b)) <= 0 )
+
+// Which list does a timer belong on ?
+#define LIST(timer)         ( (timer)->hi_res ? &z.list_hi_res : &z.list )
+
 // Module memory
 static struct
 {
     TIMER *list;
+    TIMER *list_hi_res;
 } z;
 
+// Local prototypes
+static void start( TIMER *timer, u32 ticks, u16 slack, bool hi_res );
+static void list_remove( TIMER **list, TIMER *timer );
+static void list_run( TIMER **list, u32 now );
+
 /*************************************************************************
  * Start timer, expires in N seconds
  *************************************************************************/
@@ -30,25 +58,46 @@ void timer_start_seconds( TIMER *timer, u16 seconds )
  *************************************************************************/
 void timer_start_ticks( TIMER *timer, u32 ticks )
 {
-    //DBG bool after, before=check_my_timer();
-    timer->remaining = ticks;
-    timer->taskid    = bmz_get_current_taskid();
-    //DBG if( timer->taskid == 5 /*TASKID_TCPSOCK1*/ &&
-    //DBG    timer->id == 0
-    //DBG  )
-    //DBG    printf("TIMER, start, timer->running=%s\n",
-    //DBG                          timer->running ? "true":"false" );
-    if( !timer->running )
-    {
-        timer->running = true;
-        timer->link = z.list;
-        z.list      = timer;
-    }
-    //DBG after = check_my_timer();
-    //DBG if( !before && after )
-    //DBG     printf( "Created by timer_start()!\n" );
-    //DBG if( before && !after )
-    //DBG     printf( "Removed by timer_start()!\n" );
+    start( timer, ticks, 0, false );
+}
+
+/*************************************************************************
+ * Start timer, expires in N hi res ticks
+ *************************************************************************/
+void timer_start_hi_res( TIMER *timer, u32 ticks_hi_res )
+{
+    start( timer, ticks_hi_res, 0, true );
+}
+
+/*************************************************************************
+ * Start timer with slack, expires in N seconds plus up to slack seconds
+ *************************************************************************/
+void timer_start_seconds_slack( TIMER *timer, u16 seconds,
+                                               u16 slack_seconds )
+{
+    u32 ticks = ((u32)seconds) * TICKS_PER_SECOND;
+    u32 slack = ((u32)slack_seconds) * TICKS_PER_SECOND;
+    if( slack > 0xffff )
+        slack = 0xffff;
+    start( timer, ticks, (u16)slack, false );
+}
+
+/*************************************************************************
+ * Start timer with slack, expires in N ticks plus up to slack ticks
+ *************************************************************************/
+void timer_start_ticks_slack( TIMER *timer, u32 ticks, u16 slack )
+{
+    start( timer, ticks, slack, false );
+}
+
+/*************************************************************************
+ * Start timer with slack, expires in N hi res ticks plus up to slack
+ *  hi res ticks
+ *************************************************************************/
+void timer_start_hi_res_slack( TIMER *timer, u32 ticks_hi_res,
+                                                      u16 slack_hi_res )
+{
+    start( timer, ticks_hi_res, slack_hi_res, true );
 }
 
 /*************************************************************************
@@ -57,27 +106,11 @@ void timer_start_ticks( TIMER *timer, u32 ticks )
 void timer_stop( TIMER *timer )
 {
     //DBG bool after, before=check_my_timer();
-    TIMER *temp = z.list;
-    TIMER **unlink = &z.list;
     //DBG if( timer->taskid == 5 /*TASKID_TCPSOCK1*/ &&
     //DBG     timer->id == 0
     //DBG   )
     //DBG     printf("TIMER, stop\n" );
-    while( temp )
-    {
-        if( temp == timer )
-        {
-            timer->running = false;
-            *unlink = timer->link;
-            timer->link = NULL;
-            break;
-        }
-        else
-        {
-            unlink = &temp->link;
-            temp   = temp->link;
-        }
-    }
+    list_remove( LIST(timer), timer );
     //DBG after = check_my_timer();
     //DBG if( !before && after )
     //DBG     printf( "Created by timer_stop()!\n" );
@@ -92,8 +125,10 @@ void timer_reset( TIMER *timer, byte id )
 {
     timer_stop( timer );
     timer->expired   = false;
-    timer->remaining = 0;
+    timer->expiry    = 0;
+    timer->slack     = 0;
     timer->id        = id;
+    timer->taskid    = bmz_get_current_taskid();
 }
 
 
@@ -102,7 +137,15 @@ void timer_reset( TIMER *timer, byte id )
  *************************************************************************/
 u32 timer_read ( TIMER *timer )
 {
-    return( timer->remaining );
+    u32 remaining = 0;
+    u32 now;
+    if( timer->running )
+    {
+        now = timer->hi_res ? tick_get_hi_res() : tick_get();
+        if( !BEFORE_OR_AT(timer->expiry,now) )
+            remaining = timer->expiry - now;
+    }
+    return( remaining );
 }
 
 /*************************************************************************
@@ -121,58 +164,161 @@ bool timer_running( TIMER *timer )
     return( timer->running );
 }
 
+/*************************************************************************
+ * Get earliest expiry of all running timers
+ *************************************************************************/
+bool timer_next_expiry( u32 *expiry )
+{
+    bool running = (z.list != NULL);
+    if( running )
+        *expiry = z.list->expiry;
+    return( running );
+}
+
+/*************************************************************************
+ * Get earliest expiry of all running hi res timers
+ *************************************************************************/
+bool timer_next_expiry_hi_res( u32 *expiry_hi_res )
+{
+    bool running = (z.list_hi_res != NULL);
+    if( running )
+        *expiry_hi_res = z.list_hi_res->expiry;
+    return( running );
+}
+
 /*************************************************************************
  * Run timer system, call event handlers on expiring timers
  *************************************************************************/
-void timer_run( u32 nticks )
+void timer_run( u32 now )
 {
-    TIMER *next;
-    TIMER *timer   = z.list;
-    TIMER **unlink = &z.list;
-    TIMER *expired_timers[10];
-    byte i, idx=0;
     //DBG bool after, before=check_my_timer();
-    while( timer )
+    list_run( &z.list, now );
+    //DBG after = check_my_timer();
+    //DBG if( !before && after )
+    //DBG     printf( "Created by timer_run()!\n" );
+    //DBG if( before && !after )
+    //DBG     printf( "Removed by timer_run()!\n" );
+}
+
+/*************************************************************************
+ * Run hi res timers, call event handlers on expiring timers
+ *************************************************************************/
+void timer_run_hi_res()
+{
+    // Called on every pass of the run loop, so don't read the hi res
+    //  tick (hardware access) unless a hi res timer is running
+    if( z.list_hi_res )
+        list_run( &z.list_hi_res, tick_get_hi_res() );
+}
+
+/*************************************************************************
+ * Start timer in either class
+ *************************************************************************/
+static void start( TIMER *timer, u32 ticks, u16 slack, bool hi_res )
+{
+    TIMER *temp;
+    TIMER **insert;
+    //DBG bool after, before=check_my_timer();
+
+    // A restart moves the timer (possibly to the other list), so take it
+    //  out of its current list first
+    if( timer->running )
+        list_remove( LIST(timer), timer );
+
+    // Zero ticks has always meant expire at the next tick
+    if( ticks == 0 )
+        ticks = 1;
+    timer->hi_res    = hi_res;
+    timer->expiry    = (hi_res ? tick_get_hi_res() : tick_get()) + ticks
+                                                                  + slack;
+    timer->slack     = slack;
+    //DBG if( timer->taskid == 5 /*TASKID_TCPSOCK1*/ &&
+    //DBG    timer->id == 0
+    //DBG  )
+    //DBG    printf("TIMER, start, timer->running=%s\n",
+    //DBG                          timer->running ? "true":"false" );
+
+    // Insert in expiry order, after any timers with the same expiry
+    insert = LIST(timer);
+    temp   = *insert;
+    while( temp && BEFORE_OR_AT(temp->expiry,timer->expiry) )
     {
-        next = timer->link;
-        if( nticks < timer->remaining )
+        insert = &temp->link;
+        temp   = temp->link;
+    }
+    timer->link    = temp;
+    *insert        = timer;
+    timer->running = true;
+    //DBG after = check_my_timer();
+    //DBG if( !before && after )
+    //DBG     printf( "Created by timer_start()!\n" );
+    //DBG if( before && !after )
+    //DBG     printf( "Removed by timer_start()!\n" );
+}
+
+/*************************************************************************
+ * Unlink timer from running list (if it is there)
+ *************************************************************************/
+static void list_remove( TIMER **list, TIMER *timer )
+{
+    TIMER *temp = *list;
+    TIMER **unlink = list;
+    while( temp )
+    {
+        if( temp == timer )
         {
-            timer->remaining -= nticks;
-            unlink = &timer->link;
+            timer->running = false;
+            *unlink = timer->link;
+            timer->link = NULL;
+            break;
         }
         else
+        {
+            unlink = &temp->link;
+            temp   = temp->link;
+        }
+    }
+}
+
+/*************************************************************************
+ * Expire and dispatch timers from the front of a list
+ *************************************************************************/
+static void list_run( TIMER **list, u32 now )
+{
+    TIMER *timer;
+    TIMER **unlink;
+
+    // Nothing to do unless the timer at the front of the list can wait
+    //  no longer
+    timer = *list;
+    if( !timer || !BEFORE_OR_AT(timer->expiry,now) )
+        return;
+
+    // Expire every timer whose window is open, taking them off one at a
+    //  time in expiry order. Handlers are free to start and stop timers
+    //  (including those still waiting to be dispatched), so rescan from
+    //  the front after each one. Timers started by handlers can't expire
+    //  until at least one tick in the future, so this loop always
+    //  terminates.
+    unlink = list;
+    while( NULL != (timer=*unlink) )
+    {
+        if( !BEFORE_OR_AT(timer->expiry-timer->slack,now) )
+            unlink = &timer->link;
+        else
         {
             //DBG if( timer->taskid == 5 /*TASKID_TCPSOCK1*/ &&
             //DBG     timer->id == 0
             //DBG   )
             //DBG     printf("TIMER, expired\n" );
-            if( idx >= nbrof(expired_timers) )
-            {
-                timer->remaining = 1;   // postpone timeout
-                unlink = &timer->link;
-            }
-            else
-            {
-                expired_timers[idx++] = timer;
-                timer->link = NULL;
-                *unlink = next;
-                timer->remaining = 0;
-                timer->running   = false;
-                timer->expired   = true;
-            }
+            *unlink = timer->link;
+            timer->link      = NULL;
+            timer->running   = false;
+            timer->expired   = true;
+            bmz_timeout( timer->taskid, timer->id );
+            unlink = list;
         }
-        timer = next;
-    }
-    for( i=0; i<idx; i++ )
-    {
-        timer = expired_timers[i];
-        bmz_timeout( timer->taskid, timer->id );
     }
-    //DBG after = check_my_timer();
-    //DBG if( !before && after )
-    //DBG     printf( "Created by timer_run()!\n" );
-    //DBG if( before && !after )
-    //DBG     printf( "Removed by timer_run()!\n" );
 }
 
 /*************************************************************************
@@ -15,12 +15,17 @@ typedef struct tag_TIMER
     TASKID            taskid;       // task to notify on expiry
     byte              id;           // allow task's to own more than one
                                     //  timer and distinguish between them
-    u32               remaining;    // remaining ticks until expiry
+    u32               expiry;       // absolute tick count at expiry
+    u16               slack;        // may expire up to this many ticks
+                                    //  early (to share a wakeup)
     bool              running;      // timer is running
     bool              expired;      // timer has expired
+    bool              hi_res;       // expiry is a tick_get_hi_res() count
 } TIMER;
 
-// Initialize and reset timer, assign it an ID
+// Initialize and reset timer, assign it an ID. The timer belongs to the
+//  current task, so its expiry goes to that task even if the timer is
+//  later started from some other task's context.
 void timer_reset( TIMER *timer, byte id );
 
 // Start timer, expires in N seconds
@@ -29,10 +34,29 @@ void timer_start_seconds( TIMER *timer, u16 seconds );
 // Start timer, expires in N ticks
 void timer_start_ticks( TIMER *timer, u32 ticks );
 
+// Start timer, expires in N hi res ticks (rate TICKS_PER_SECOND_HI_RES,
+//  the hi res tick count wraps every 6 hours so keep well below that)
+void timer_start_hi_res( TIMER *timer, u32 ticks_hi_res );
+
+// Start timer with slack, expires after N seconds but may be delayed by
+//  up to slack seconds, so that it can share a wakeup with other timers
+void timer_start_seconds_slack( TIMER *timer, u16 seconds,
+                                               u16 slack_seconds );
+
+// Start timer with slack, expires after N ticks but may be delayed by up
+//  to slack ticks
+void timer_start_ticks_slack( TIMER *timer, u32 ticks, u16 slack );
+
+// Start timer with slack, expires after N hi res ticks but may be delayed
+//  by up to slack hi res ticks
+void timer_start_hi_res_slack( TIMER *timer, u32 ticks_hi_res,
+                                                      u16 slack_hi_res );
+
 // Stop and unlink timer
 void timer_stop( TIMER *timer );
 
-// Read time remaining in ticks
+// Read time remaining in ticks (hi res ticks if started with
+//  timer_start_hi_res())
 u32 timer_read ( TIMER *timer );
 
 // Test whether timer has expired
@@ -41,7 +65,19 @@ bool timer_expired( TIMER *timer );
 // Test whether timer is running
 bool timer_running( TIMER *timer );
 
+// Get earliest expiry of all running timers (eg to calculate how long
+//  we can sleep), returns false if no timers are running. For a timer
+//  with slack this is the latest time it can expire.
+bool timer_next_expiry( u32 *expiry );
+
+// Get earliest expiry of all running hi res timers, returns false if no
+//  hi res timers are running
+bool timer_next_expiry_hi_res( u32 *expiry_hi_res );
+
 // Run timer system, call event handlers on expiring timers
-void timer_run( u32 nticks );   // called by BMZ, not for users
+void timer_run( u32 now );      // called by BMZ, not for users
+
+// Run hi res timers, call event handlers on expiring timers
+void timer_run_hi_res();        // called by BMZ, not for users
 
 #endif // TIMER_H
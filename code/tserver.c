@@ -10,6 +10,7 @@
 #include "bmz.h"
 #include "tcpsock.h"
 #include "uart.h"
+#include "console.h"
 #include "tserver.h"
 
 // Use the listen callback feature to implement a simple method for
@@ -137,7 +138,15 @@ void tserver_idle()
 {
     TSERVER *z = bmz_get_current_instance();
     MSG *msg;
+    bool commands=false;
     PUBLISH_STATE publish_state = bmz_get_publish_state(z->taskid_tcpsock);
+
+    // The console UART takes debug commands instead, if enabled
+    #ifdef DEBUG_CONSOLE
+    commands = ( z->uart_id == CONSOLE_UART );
+    if( commands )
+        console_poll();
+    #endif
     if( publish_state == PUBLISH_IDLE )
     {
         msg = pool_alloc( bmz_get_current_pool() );
@@ -148,7 +157,7 @@ void tserver_idle()
             bmz_down( z->taskid_tcpsock, msg );
         }
     }
-    else if( publish_state == PUBLISH_ACTIVE )
+    else if( publish_state == PUBLISH_ACTIVE && !commands )
     {
         if( uart_read_test(z->uart_id) )
         {
@@ -0,0 +1,266 @@
+/*************************************************************************
+ * udp.c
+ *
+ *  udp = User Datagram Protocol
+ *  Project: eZ2944
+ *************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "project.h"
+#include "bmz.h"
+#include "tcpip.h"
+#include "checksum.h"
+#include "ether.h"
+#include "ip.h"
+#include "udp.h"
+
+// Each bound port has a receive filter in the ether layer, so datagrams
+//  for ports nobody wants are dropped before they cost anything. IP still
+//  gets them first, so fragmented datagrams are reassembled.
+
+// Misc
+#define UDP_HEADER_LEN 8
+
+// Socket, one for each bound port
+typedef struct
+{
+    bool    inuse;
+    u16     port;
+    TASKID  taskid;
+    bool    checksum;
+} SOCKET;
+
+// Module data
+typedef struct
+{
+    SOCKET  sock[UDP_SOCK_NBR];
+} UDP;
+static UDP z;
+
+// Local prototypes
+static SOCKET *lookup( u16 port );
+
+/*************************************************************************
+ * Init
+ *************************************************************************/
+void *udp_init( byte **addr_mem, u16 *addr_len )
+{
+    memset( &z, 0, sizeof(z) );
+    return( &z );
+}
+
+/*************************************************************************
+ * Message down
+ *************************************************************************/
+// Message format in (down from app, see udp_send());
+//      [dst_ipaddr,4]
+//      [src_port,2]
+//      [dst_port,2]
+//      [user data]
+// Message format out (down to IP);
+//      [ip protocol nbr,1]
+//      [dst_ipaddr,4]
+//      [payload] = [udp datagram] = [udp hdr + udp data]
+void udp_down( MSG *msg )
+{
+    u16 len, checksum=0, *poke;
+    SOCKET *sock;
+
+    // Take off parameters
+    IPADDR dst_ipaddr = msg_pop4(msg);
+    u16    src_port   = msg_pop2(msg);
+    u16    dst_port   = msg_pop2(msg);
+
+    // Add udp header
+    len = msg_len(msg) + UDP_HEADER_LEN;
+    msg_push2( msg, 0 );             // checksum
+    msg_push2( msg, len );           // length
+    msg_push2( msg, dst_port );      // dst port
+    msg_push2( msg, src_port );      // src port
+
+    // Checksum unless the port doesn't want one, the link inserts it or
+    //  the datagram is looped back
+    sock = lookup( src_port );
+    if( (!sock || sock->checksum) && !ip_loopback(dst_ipaddr) &&
+        !(ether_get_caps() & ETHER_CAPS_TX_CSUM)
+      )
+    {
+
+        // Add pseudo header
+        msg_push2( msg, len );
+        msg_push1( msg, PROTOCOL_UDP );
+        msg_push1( msg, 0 );
+        msg_push4( msg, dst_ipaddr );
+        msg_push4( msg, config.my_ipaddr );    // src ipaddr
+        checksum = checksum_calculate( msg_ptr(msg), msg_len(msg) );
+
+        // Remove pseudo header, zero means no checksum so send all ones
+        //  instead (the same in ones complement arithmetic)
+        msg_pop( msg, 12 );
+        if( checksum == 0 )
+            checksum = 0xffff;
+    }
+    poke  = (u16 *)( msg_ptr(msg) + 6 );
+    *poke = checksum;
+
+    // Add output parameters
+    msg_push4( msg, dst_ipaddr );
+    msg_push1( msg, PROTOCOL_UDP );
+
+    // To IP
+    bmz_down( TASKID_IP, msg );
+}
+
+
+/*************************************************************************
+ * Message up
+ *************************************************************************/
+// Message format in (up from IP);
+//      [loopback,1]
+//      [src_ipaddr,4]
+//      [dst_ipaddr,4]  = our address, or a broadcast
+//      [payload] = [udp datagram] = [udp hdr + udp data]
+// Message format out (up to app);
+//      [src_ipaddr,4]
+//      [src_port,2]
+//      [dst_port,2]
+//      [user data]
+void udp_up( MSG *msg )
+{
+    bool   err=false;
+    u16    src_port, dst_port, len;
+    SOCKET *sock=NULL;
+
+    // Take off parameters
+    bool   loopback   = msg_pop1(msg);
+    IPADDR rem_ipaddr = msg_pop4(msg);
+    IPADDR dst_ipaddr = msg_pop4(msg);
+    u16    datagram_len = msg_len(msg);
+
+    // Test basic validity and find socket
+    if( datagram_len < UDP_HEADER_LEN )
+        err = true;
+    else
+    {
+        len = msg_read2(msg,4);
+        if( len<UDP_HEADER_LEN || len>datagram_len )
+            err = true;
+        else
+        {
+            msg_len(msg) = len;     // assumes msg_len() is macro
+            sock = lookup( msg_read2(msg,2) );
+            if( !sock )
+                err = true;
+        }
+    }
+
+    // Test checksum, if the port wants it, the link hasn't already and it
+    //  wasn't looped back
+    if( !err && sock->checksum && !loopback &&
+        !(ether_get_caps()&ETHER_CAPS_RX_CSUM)
+      )
+    {
+
+        // Add pseudo header
+        msg_push2( msg, len );
+        msg_push1( msg, PROTOCOL_UDP );
+        msg_push1( msg, 0 );
+        msg_push4( msg, dst_ipaddr );
+        msg_push4( msg, rem_ipaddr );
+
+        // Test checksum (offset is 6 bytes into datagram
+        //  + 12 byte pseudo header)
+        err = checksum_test( msg_ptr(msg), msg_len(msg), 12+6 );
+
+        // Pop off pseudo header
+        msg_pop( msg, 12 );
+    }
+
+    // Take off the udp header, add output parameters and dispatch
+    if( !err )
+    {
+        src_port = msg_pop2( msg );  // src port
+        dst_port = msg_pop2( msg );  // dst port
+                   msg_pop2( msg );  // length
+                   msg_pop2( msg );  // checksum
+        msg_push2( msg, dst_port );
+        msg_push2( msg, src_port );
+        msg_push4( msg, rem_ipaddr );
+        bmz_up( sock->taskid, msg );
+    }
+
+    // If error, discard
+    else
+        msg_free(msg);
+}
+
+
+/*************************************************************************
+ * Bind a port to a task
+ *************************************************************************/
+bool udp_bind( u16 port, TASKID taskid, bool checksum )
+{
+    SOCKET *sock=NULL;
+    byte   i;
+
+    // Find a free socket
+    if( lookup(port) )
+        return( false );
+    for( i=0; i<UDP_SOCK_NBR && !sock; i++ )
+    {
+        if( !z.sock[i].inuse )
+            sock = &z.sock[i];
+    }
+
+    // Let datagrams for the port through the ether layer (to IP first)
+    if( !sock || !ether_filter_add( FRAME_TYPE_IP, PROTOCOL_UDP, port, port,
+                                       ETHER_FILTER_BROADCAST, TASKID_IP ) )
+        return( false );
+    sock->inuse    = true;
+    sock->port     = port;
+    sock->taskid   = taskid;
+    sock->checksum = checksum;
+    return( true );
+}
+
+
+/*************************************************************************
+ * Unbind a port
+ *************************************************************************/
+void udp_unbind( u16 port )
+{
+    SOCKET *sock = lookup( port );
+    if( sock )
+    {
+        ether_filter_remove( FRAME_TYPE_IP, PROTOCOL_UDP, port, port );
+        sock->inuse = false;
+    }
+}
+
+
+/*************************************************************************
+ * Send a datagram
+ *************************************************************************/
+void udp_send( MSG *msg, IPADDR dst_ipaddr, u16 dst_port, u16 src_port )
+{
+    msg_push2( msg, dst_port );
+    msg_push2( msg, src_port );
+    msg_push4( msg, dst_ipaddr );
+    bmz_down( TASKID_UDP, msg );
+}
+
+
+/*************************************************************************
+ * Find the socket bound to a port
+ *************************************************************************/
+static SOCKET *lookup( u16 port )
+{
+    SOCKET *sock;
+    byte   i;
+    for( i=0, sock=z.sock; i<UDP_SOCK_NBR; i++, sock++ )
+    {
+        if( sock->inuse && sock->port==port )
+            return( sock );
+    }
+    return( NULL );
+}
@@ -0,0 +1,39 @@
+/*************************************************************************
+ * udp.h
+ *
+ *  udp = User Datagram Protocol
+ *  Project: eZ2944
+ *************************************************************************/
+#ifndef  UDP_H
+#define  UDP_H
+#include "bmz.h"
+#include "tcpip.h"
+
+// A task receives datagrams for a port by binding to it. Datagrams are
+//  passed to the task's up handler in the MSG they arrived in, with no
+//  copying, the task must msg_free() them when it is done;
+//      [src_ipaddr,4]
+//      [src_port,2]
+//      [dst_port,2]
+//      [data]
+// To send, build data in a MSG (from a pool with offset for the UDP, IP
+//  and ethernet headers, DEFAULT_POOL_OFFSET is enough) and call
+//  udp_send(), the MSG is freed once it has been sent. If checksum is
+//  false, datagrams sent from the port carry no checksum and received
+//  datagrams aren't checked, which saves time on trusted links.
+
+// Prototypes
+void *udp_init( byte **addr_mem, u16 *addr_len );
+void  udp_down( MSG *msg );
+void  udp_up( MSG *msg );
+
+// Bind a port to a task, returns false if already bound or no room
+bool  udp_bind( u16 port, TASKID taskid, bool checksum );
+
+// Unbind a port
+void  udp_unbind( u16 port );
+
+// Send a datagram
+void  udp_send( MSG *msg, IPADDR dst_ipaddr, u16 dst_port, u16 src_port );
+
+#endif  // UDP_H
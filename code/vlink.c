@@ -0,0 +1,216 @@
+/*************************************************************************
+ * vlink.c
+ *
+ *  Virtual ethernet link with impairments, for the PC hosted build
+ *  Project: eZ2944
+ *************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "bmz.h"
+#include "vlink.h"
+
+// Each direction has a fixed number of slots for frames in transit. A
+//  frame sent into the link is given a delivery time, made up of
+//  serialization at the link bandwidth (frames queue behind each other),
+//  latency, random jitter, and an extra hold back if the frame is chosen
+//  to be reordered. Frames are delivered in order of delivery time, so
+//  jitter and hold backs let later frames overtake earlier ones. Random
+//  choices come from our own generator, so a given seed always gives the
+//  same run.
+
+// Misc
+#define SLOT_NBR         32     // frames in transit, each direction
+#define REORDER_HOLD_MIN 1000   // reordered frames held back at least
+                                //  this many uS
+
+// A frame in transit
+typedef struct
+{
+    bool    inuse;
+    double  due_usec;
+    u16     len;
+    byte    frame[VLINK_MAXFRAME];
+} SLOT;
+
+// One direction of the link
+typedef struct
+{
+    SLOT        slot[SLOT_NBR];
+    double      busy_until;     // end of serialization of last frame
+    VLINK_STATS stats;
+} DIRECTION;
+
+// Module data
+typedef struct
+{
+    VLINK_CONFIG cfg;
+    u32          random;
+    DIRECTION    dir[VLINK_NBR_ENDS];   // indexed by sending end
+} VLINK;
+static VLINK z;
+
+// Local prototypes
+static u32 random_next();
+static bool random_per_1000( u16 per_1000 );
+
+/*************************************************************************
+ * Setup link
+ *************************************************************************/
+void vlink_init( const VLINK_CONFIG *cfg )
+{
+    memset( &z, 0, sizeof(z) );
+    z.cfg    = *cfg;
+    z.random = ( cfg->seed ? cfg->seed : 1 );  // generator sticks at 0
+}
+
+/*************************************************************************
+ * Read link settings from environment variables
+ *************************************************************************/
+void vlink_config_from_env( VLINK_CONFIG *cfg )
+{
+    const char *s;
+    s = getenv( "BMZ_VLINK_BANDWIDTH" );
+    cfg->bandwidth = ( s ? (u32)atol(s) : 0 );
+    s = getenv( "BMZ_VLINK_LATENCY" );
+    cfg->latency   = ( s ? (u32)atol(s) : 0 );
+    s = getenv( "BMZ_VLINK_JITTER" );
+    cfg->jitter    = ( s ? (u32)atol(s) : 0 );
+    s = getenv( "BMZ_VLINK_LOSS" );
+    cfg->loss      = ( s ? (u16)atoi(s) : 0 );
+    s = getenv( "BMZ_VLINK_REORDER" );
+    cfg->reorder   = ( s ? (u16)atoi(s) : 0 );
+    s = getenv( "BMZ_VLINK_SEED" );
+    cfg->seed      = ( s ? (u32)atol(s) : 0 );
+}
+
+/*************************************************************************
+ * Send frame from one end
+ *************************************************************************/
+bool vlink_send( byte from_end, const byte *frame, u16 len,
+                                                      double now_usec )
+{
+    DIRECTION *d = &z.dir[from_end];
+    SLOT *slot=NULL;
+    double start, hold;
+    byte i;
+    d->stats.frames_sent++;
+    d->stats.bytes_sent += len;
+
+    // Lost ?
+    if( random_per_1000(z.cfg.loss) )
+    {
+        d->stats.frames_lost++;
+        return( false );
+    }
+
+    // Find a free slot
+    for( i=0; i<SLOT_NBR && !slot; i++ )
+    {
+        if( !d->slot[i].inuse )
+            slot = &d->slot[i];
+    }
+    if( !slot || len>VLINK_MAXFRAME )
+    {
+        d->stats.frames_overflow++;
+        return( false );
+    }
+
+    // Serialize behind frames already on the wire
+    start = ( d->busy_until > now_usec ? d->busy_until : now_usec );
+    if( z.cfg.bandwidth )
+        d->busy_until = start + (len*8.0*1000000.0) / z.cfg.bandwidth;
+    else
+        d->busy_until = start;
+
+    // Then delay
+    slot->due_usec = d->busy_until + z.cfg.latency;
+    if( z.cfg.jitter )
+        slot->due_usec += random_next() % (z.cfg.jitter+1);
+    if( random_per_1000(z.cfg.reorder) )
+    {
+        hold = ( z.cfg.latency > REORDER_HOLD_MIN ?
+                                    z.cfg.latency : REORDER_HOLD_MIN );
+        slot->due_usec += hold;
+        d->stats.frames_reordered++;
+    }
+    slot->inuse = true;
+    slot->len   = len;
+    memcpy( slot->frame, frame, len );
+    return( true );
+}
+
+/*************************************************************************
+ * Receive frame at one end
+ *************************************************************************/
+u16 vlink_receive( byte to_end, byte *frame, double now_usec )
+{
+    DIRECTION *d = &z.dir[VLINK_NBR_ENDS-1-to_end];  // from other end
+    SLOT *slot=NULL;
+    u16 len=0;
+    byte i;
+
+    // Earliest frame that is due
+    for( i=0; i<SLOT_NBR; i++ )
+    {
+        if( d->slot[i].inuse && d->slot[i].due_usec<=now_usec )
+        {
+            if( !slot || d->slot[i].due_usec<slot->due_usec )
+                slot = &d->slot[i];
+        }
+    }
+    if( slot )
+    {
+        len = slot->len;
+        memcpy( frame, slot->frame, len );
+        slot->inuse = false;
+        d->stats.frames_delivered++;
+        d->stats.bytes_delivered += len;
+    }
+    return( len );
+}
+
+/*************************************************************************
+ * Test whether any frames are still in transit
+ *************************************************************************/
+bool vlink_busy()
+{
+    byte end, i;
+    for( end=0; end<VLINK_NBR_ENDS; end++ )
+    {
+        for( i=0; i<SLOT_NBR; i++ )
+        {
+            if( z.dir[end].slot[i].inuse )
+                return( true );
+        }
+    }
+    return( false );
+}
+
+/*************************************************************************
+ * Get statistics for frames sent from one end
+ *************************************************************************/
+void vlink_get_stats( byte from_end, VLINK_STATS *stats )
+{
+    *stats = z.dir[from_end].stats;
+}
+
+/*************************************************************************
+ * Random number generator (xorshift), same sequence on any host
+ *************************************************************************/
+static u32 random_next()
+{
+    u32 x = z.random;
+    x ^= (x << 13) & 0xffffffff;
+    x ^= (x >> 17);
+    x ^= (x << 5)  & 0xffffffff;
+    z.random = x;
+    return( x );
+}
+
+/*************************************************************************
+ * Random event, probability per 1000
+ *************************************************************************/
+static bool random_per_1000( u16 per_1000 )
+{
+    return( per_1000 && (random_next()%1000) < per_1000 );
+}
@@ -0,0 +1,64 @@
+/*************************************************************************
+ * vlink.h
+ *
+ *  Virtual ethernet link with impairments, for the PC hosted build
+ *  Project: eZ2944
+ *************************************************************************/
+#ifndef VLINK_H
+#define VLINK_H
+#include "bmz.h"
+
+// The link is a point to point link between two ends, each direction is
+//  impaired independently but with the same settings
+#define VLINK_STACK     0       // our BMZ stack
+#define VLINK_PEER      1       // whatever we are talking to
+#define VLINK_NBR_ENDS  2
+#define VLINK_MAXFRAME  1514
+
+// Link settings, all zero gives an ideal link
+typedef struct
+{
+    u32 bandwidth;      // bits per second, 0 = unlimited
+    u32 latency;        // one way delay, uS
+    u32 jitter;         // extra random delay, 0 to jitter uS
+    u16 loss;           // frames lost, per 1000
+    u16 reorder;        // frames held back so later frames overtake
+                        //  them, per 1000
+    u32 seed;           // random number seed, for repeatable runs
+} VLINK_CONFIG;
+
+// Link statistics, for frames sent from one end
+typedef struct
+{
+    u32 frames_sent;
+    u32 bytes_sent;
+    u32 frames_lost;        // by loss setting
+    u32 frames_overflow;    // link queue full
+    u32 frames_reordered;
+    u32 frames_delivered;
+    u32 bytes_delivered;
+} VLINK_STATS;
+
+// Setup link
+void vlink_init( const VLINK_CONFIG *cfg );
+
+// Read link settings from environment variables BMZ_VLINK_BANDWIDTH,
+//  BMZ_VLINK_LATENCY, BMZ_VLINK_JITTER, BMZ_VLINK_LOSS,
+//  BMZ_VLINK_REORDER and BMZ_VLINK_SEED (missing variables read as zero)
+void vlink_config_from_env( VLINK_CONFIG *cfg );
+
+// Send frame from one end, returns false if it was lost or the link
+//  queue is full
+bool vlink_send( byte from_end, const byte *frame, u16 len,
+                                                      double now_usec );
+
+// Receive frame at one end, returns length of frame or 0 if none due
+u16 vlink_receive( byte to_end, byte *frame, double now_usec );
+
+// Test whether any frames are still in transit
+bool vlink_busy();
+
+// Get statistics for frames sent from one end
+void vlink_get_stats( byte from_end, VLINK_STATS *stats );
+
+#endif  // VLINK_H